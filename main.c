@@ -1,15 +1,17 @@
 #include <stdint.h>
 #include <avr/io.h>
 #include <avr/delay.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
 #include "fs/ff.h"
 #include "fs/diskio.h"
 
 // TODO:
-// Large OSR's
-// Low power sleep mode (slow clock)
 // Power off SD
 
 void sd_power_off();
+uint8_t log_write_sector();
+void write_banner(uint8_t restarted);
 
 #define PORTC_E_CARD (1 << 0)
 #define PORTC_E_SENSOR (1 << 1)
@@ -19,13 +21,95 @@ void sd_power_off();
 #define PORTA_CS (1 << 7)
 
 uint32_t log_interval = 1000; // ms
-int oversampling_ratio = 47; // Chosen to null out 60 Hz interference
+int32_t oversampling_ratio = 47; // Chosen to null out 60 Hz interference
 
 // 0: Sum up OSR samples
 // 1: Record OSR independant samples
+// 2: Record OSR independant samples continuously, without gaps (OSR <= 256).
+//    The card stays powered, whatever card_sleep_readings is: powering it
+//    up again takes longer than recording the next burst.
 int burst_mode = 0;
 #define MAX_BURST 512
-int16_t burst_buffer[MAX_BURST]; 
+
+// Oversampling adds up samples as they come in, into a 64 bit sum. The
+// limit is just to keep a reading from taking forever.
+#define MAX_OSR 100000
+
+// Half-cycles of the drive coil added up into each sample. Samples are
+// 32 bits: up to 10000 half-cycles of +-32768 (16x accumulation) each.
+int32_t integration = 10;
+#define MAX_INTEGRATION 10000
+
+// Unix time at power up from the config, 0 if not set
+uint32_t config_time = 0;
+
+// Size of the contiguous area reserved for a new log file, in MB. 0 lets
+// the file grow cluster by cluster.
+int32_t preallocate = 64;
+
+// Start a new log file once the current one has reached rotate_size MB, or
+// has rotate_readings readings in it (a burst counts as one reading). 0 is
+// no limit. With either set, the log is split over FG000001.CSV/BIN, 
+// FG000002.CSV/BIN, ... instead of going into FLUXGATE.CSV/BIN.
+int32_t rotate_size = 0;
+int32_t rotate_readings = 0;
+
+// Write an energy record (see write_energy()) every this many writes to the
+// card, 0 for none.
+int32_t energy_log = 0;
+
+// A half-cycle averaging more than this (in single conversions, 0.5 mV) is
+// counted as saturated.
+#define SATURATION 900
+
+// Oversampled readings are queued up in RAM and written out in batches,
+// so the card only has to be woken up (and FatFs only has to update the
+// FAT and directory entry) once per batch instead of once per reading.
+// A full queue of ~30 byte lines is about six sectors.
+typedef struct {
+	uint32_t counter;
+	uint32_t time; // Unix time
+	uint16_t ms;
+	uint16_t saturated; // Number of saturated half-cycles
+	int64_t value;
+} record_t;
+
+// Only burst modes keep raw samples around, oversampling uses the same
+// memory to queue readings.
+#define MAX_QUEUE (MAX_BURST * sizeof(int32_t) / sizeof(record_t))
+union {
+	int32_t burst[MAX_BURST]; 
+	record_t queue[MAX_QUEUE];
+} buffers;
+uint8_t queued_records = 0;
+// Records at the start of the queue that are already in the last block of
+// a binary log, which isn't full yet. The next batch fills it up, and it's
+// written again, so a small batch doesn't take up a whole block.
+uint8_t open_records = 0;
+
+// Number of writes the card is kept powered (but deselected) for
+// before being fully powered off. 0 powers it off after every write.
+// Not used in continuous burst mode, where the card is never powered off.
+int32_t card_sleep_readings = 0;
+
+// Number of oversampled readings to collect in RAM before writing them to 
+// the card, limited to MAX_QUEUE. Unwritten readings are lost on power loss.
+int32_t batch_size = 1;
+
+// 0: Text log in FLUXGATE.CSV
+// 1: Binary log in FLUXGATE.BIN, see "Binary log format" and block_write()
+// 2: Binary log, with bursts compressed (BLOCK_BURST_RICE)
+int32_t log_format = 0;
+
+// Number of ADC conversions added up in hardware for each half-cycle, as a
+// power of two (0-7, so 1 to 128 conversions). The ADC accumulates up to 16
+// results at full resolution, above that it shifts the sum down to fit.
+int32_t adc_accumulation = 0;
+
+// Readings are this power of two larger than with single conversions
+uint8_t adc_scale() {
+	return adc_accumulation > 4 ? 4 : adc_accumulation;
+}
 
 FATFS fs;
 FIL fd;
@@ -35,7 +119,7 @@ void read_config() {
 	if (f_open(&config, "FLUXGATE.CFG", FA_READ)) return;
 
 	int32_t value;
-	uint16_t len;
+	UINT len;
 	
 	// Read log interval
 	f_read(&config, &value, sizeof(int32_t), &len);
@@ -48,8 +132,64 @@ void read_config() {
 	// Burst mode
 	f_read(&config, &value, sizeof(int32_t), &len);
 	if (len > 0) burst_mode = value;
+
+	// Card power policy
+	f_read(&config, &value, sizeof(int32_t), &len);
+	if (len > 0) card_sleep_readings = value;
+
+	// Readings per write
+	f_read(&config, &value, sizeof(int32_t), &len);
+	if (len > 0) batch_size = value;
+
+	// Log format
+	f_read(&config, &value, sizeof(int32_t), &len);
+	if (len > 0) log_format = value;
+
+	// Hardware accumulation
+	f_read(&config, &value, sizeof(int32_t), &len);
+	if (len > 0) adc_accumulation = value;
+
+	// Half-cycles per sample
+	f_read(&config, &value, sizeof(int32_t), &len);
+	if (len > 0) integration = value;
+
+	// Time
+	f_read(&config, &value, sizeof(int32_t), &len);
+	if (len > 0) config_time = value;
+
+	// Log file preallocation
+	f_read(&config, &value, sizeof(int32_t), &len);
+	if (len > 0) preallocate = value;
+
+	// Log rotation
+	f_read(&config, &value, sizeof(int32_t), &len);
+	if (len > 0) rotate_size = value;
+	f_read(&config, &value, sizeof(int32_t), &len);
+	if (len > 0) rotate_readings = value;
+
+	// Energy records
+	f_read(&config, &value, sizeof(int32_t), &len);
+	if (len > 0) energy_log = value;
 	
-	if (oversampling_ratio > MAX_BURST) oversampling_ratio = MAX_BURST;
+	if (log_format < 0 || log_format > 2) log_format = 0; // Unknown, fall back to CSV
+	if (adc_accumulation < 0) adc_accumulation = 0;
+	if (adc_accumulation > 7) adc_accumulation = 7;
+	if (burst_mode && oversampling_ratio > MAX_BURST) oversampling_ratio = MAX_BURST;
+	if (log_interval < 1) log_interval = 1;
+	if (oversampling_ratio > MAX_OSR) oversampling_ratio = MAX_OSR;
+	if (oversampling_ratio < 1) oversampling_ratio = 1;
+	if (integration > MAX_INTEGRATION) integration = MAX_INTEGRATION;
+	if (integration < 2) integration = 2;
+	integration &= ~1; // Whole cycles, so any offset cancels out
+	if (preallocate < 0) preallocate = 0;
+	if (preallocate > 4095) preallocate = 4095; // FAT file size limit
+	if (rotate_size < 0) rotate_size = 0;
+	if (rotate_size > 4095) rotate_size = 4095;
+	if (rotate_readings < 0) rotate_readings = 0;
+	if (energy_log < 0) energy_log = 0;
+	if (rotate_size && preallocate > rotate_size) preallocate = rotate_size;
+	if (batch_size < 1) batch_size = 1;
+	if (batch_size > (int32_t)MAX_QUEUE) batch_size = MAX_QUEUE;
 
 	f_close(&config);
 }
@@ -74,7 +214,8 @@ void saturated(){
 
 // Two quick flashes then delay
 void self_test_failure() {
-	f_printf(&fd, ",,Self test failed. Giving up.\n"); 
+	// The binary header already records the failure
+	if (!log_format) f_printf(&fd, ",,Self test failed. Giving up.\n"); 
 	f_close(&fd);
 	sd_power_off(); // Ensure that the log file is written
 	while (1) {
@@ -89,6 +230,241 @@ void self_test_failure() {
 	}
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// Time keeping.                                                            //
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+
+// The RTC counts the internal 32.768 kHz oscillator. Its 16 bit counter
+// wraps every 2 seconds, the overflow interrupt extends it in software to 
+// 48 bits, which is good for a few hundred years.
+#define RTC_HZ 32768UL
+
+volatile uint32_t rtc_wraps;
+
+ISR(RTC_CNT_vect) {
+	uint8_t flags = RTC.INTFLAGS;
+	if (flags & 0x1) rtc_wraps++; // OVF
+	RTC.INTFLAGS = flags;
+}
+
+void rtc_setup() {
+	RTC.CLKSEL = 0x0; // Internal 32.768 kHz oscillator
+	while (RTC.STATUS) ;
+	RTC.PER = 0xFFFF;
+	RTC.INTCTRL = 0x1; // Overflow interrupt
+	RTC.CTRLA = 1 << 7 | 1; // Run in standby, no prescaler, enable
+	while (RTC.STATUS) ;
+}
+
+// Ticks since the RTC was started, with interrupts already off
+uint64_t rtc_read() {
+	uint16_t count = RTC.CNT;
+	uint32_t wraps = rtc_wraps;
+	if (RTC.INTFLAGS & 0x1) {
+		// Wrapped, but the interrupt hasn't run yet
+		count = RTC.CNT;
+		wraps++;
+	}
+	return (uint64_t)wraps << 16 | count;
+}
+
+// Ticks since the RTC was started
+uint64_t rtc_now() {
+	cli();
+	uint64_t ticks = rtc_read();
+	sei();
+	return ticks;
+}
+
+// Unix time when the RTC was started. It's set from the TIME field of the
+// config or the last time in the log, whichever is later, so the time 
+// carries on across restarts even without a battery backed clock. Restarts
+// do lose the time the logger was off for.
+uint32_t time_base = 0;
+
+// Unix time at an RTC tick count, and the milliseconds into that second if
+// ms isn't 0
+uint32_t time_at(uint64_t ticks, uint16_t* ms) {
+	if (ms) *ms = (ticks % RTC_HZ) * 1000 / RTC_HZ;
+	return time_base + ticks / RTC_HZ;
+}
+
+// Current Unix time, and the milliseconds into that second if ms isn't 0
+uint32_t time_now(uint16_t* ms) {
+	return time_at(rtc_now(), ms);
+}
+
+// Make time the current time, unless it's already later than that
+void time_set(uint32_t time) {
+	if (time > time_now(0)) time_base = time - rtc_now() / RTC_HZ;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// Energy accounting. Where the time goes, in RTC ticks, for working out    //
+// the battery life: how long the CPU was in standby, or idle while         //
+// measuring, and how long the sensor and card were powered, and the card   //
+// busy programing. Written to the log by write_energy().                   //
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+
+// 64 bit, so any energy_log interval fits: 32 bits of RTC ticks only last
+// 36 hours.
+typedef struct {
+	uint64_t elapsed;
+	uint64_t standby;
+	uint64_t idle;
+	uint64_t sensor;
+	uint64_t card;
+	uint64_t card_busy;
+	uint32_t readings;
+} energy_t;
+
+energy_t energy;
+uint64_t energy_since; // When the counts were last reset
+uint64_t sensor_on_since, card_on_since; // 0 if off
+
+void energy_sensor(uint8_t on) {
+	uint64_t now = rtc_now();
+	if (sensor_on_since) energy.sensor += now - sensor_on_since;
+	sensor_on_since = on ? now | 1 : 0; // Not 0, even right at startup
+}
+
+void energy_card(uint8_t on) {
+	uint64_t now = rtc_now();
+	if (card_on_since) energy.card += now - card_on_since;
+	card_on_since = on ? now | 1 : 0;
+}
+
+// Bring the counts up to now, and start over. Returns the counts since the
+// last time.
+energy_t energy_take() {
+	energy_sensor(sensor_on_since != 0);
+	energy_card(card_on_since != 0);
+	uint64_t now = rtc_now();
+	energy.elapsed = now - energy_since;
+	energy_since = now;
+
+	energy_t taken = energy;
+	energy_t empty = {0};
+	energy = empty;
+	return taken;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// Timing trace, for finding out where the time goes on a real card. Built  //
+// in with TRACE=1 (make TRACE=1), the calls compile to nothing otherwise.  //
+//                                                                          //
+// TCB1 counts at F_CPU/2, and its overflow interrupt extends it to 32      //
+// bits. It stops in standby, so the trace only covers the time the CPU is  //
+// awake. The start and end of each traced operation go into a small        //
+// buffer in RAM, which is appended to TRACE.BIN on the card once it's half //
+// full, as uint8 count, count * uint8 event (with TRACE_END set for the    //
+// end of the operation), count * uint32 ticks. scripts/decode_trace.py     //
+// summarizes it.                                                           //
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef TRACE
+#define TRACE 0
+#endif
+
+#define TRACE_RESTART 1 // Ticks is the Unix time instead
+#define TRACE_MEASURE 2 // measure()
+#define TRACE_SD_INIT 3 // sd_init()
+#define TRACE_WRITE 4 // Formatting and writing records to the log
+#define TRACE_SYNC 5 // f_sync() of the log
+#define TRACE_BUSY 6 // Waiting for the card to finish programing
+#define TRACE_POWER_OFF 7 // sd_power_off()
+#define TRACE_LOST 8 // Ticks is the number of entries that didn't fit
+#define TRACE_END 0x80
+
+#if TRACE
+#define TRACE_SIZE 64
+
+volatile uint16_t trace_wraps;
+uint8_t trace_events[TRACE_SIZE + 1]; // Room for TRACE_LOST
+uint32_t trace_ticks[TRACE_SIZE + 1];
+uint8_t trace_count;
+uint32_t trace_lost;
+uint8_t trace_dumping; // Don't trace writing the trace
+FIL trace_fd;
+
+ISR(TCB1_INT_vect) {
+	trace_wraps++;
+	TCB1.INTFLAGS = 1;
+}
+
+uint32_t trace_now() {
+	cli();
+	uint16_t count = TCB1.CNT;
+	uint16_t wraps = trace_wraps;
+	if (TCB1.INTFLAGS & 1) {
+		// Wrapped, but the interrupt hasn't run yet
+		count = TCB1.CNT;
+		wraps++;
+	}
+	sei();
+	return (uint32_t)wraps << 16 | count;
+}
+
+void trace_put(uint8_t event, uint32_t ticks) {
+	if (trace_dumping) return;
+	if (trace_count == TRACE_SIZE) {
+		trace_lost++;
+		return;
+	}
+	trace_events[trace_count] = event;
+	trace_ticks[trace_count] = ticks;
+	trace_count++;
+}
+
+void trace(uint8_t event) {
+	trace_put(event, trace_now());
+}
+
+void trace_setup() {
+	TCB1.CTRLB = 0x0; // Periodic interrupt mode
+	TCB1.CCMP = 0xFFFF;
+	TCB1.CNT = 0;
+	TCB1.INTCTRL = 0x1; // Capture interrupt
+	TCB1.CTRLA = 0x1 << 1 | 0x1; // clk_per/2, enable
+}
+
+// Once the log is open: open the trace file, and mark the restart
+void trace_open(uint32_t time) {
+	if (f_open(&trace_fd, "/TRACE.BIN", FA_WRITE | FA_OPEN_APPEND)) return;
+	trace_put(TRACE_RESTART, time);
+}
+
+// Append the buffer to the trace file if it's getting full, while the card 
+// is awake anyway
+void trace_dump() {
+	if (trace_count < TRACE_SIZE / 2 || !trace_fd.obj.fs) return;
+	trace_dumping = 1;
+	if (trace_lost) {
+		trace_events[trace_count] = TRACE_LOST;
+		trace_ticks[trace_count++] = trace_lost;
+		trace_lost = 0;
+	}
+	UINT written;
+	f_write(&trace_fd, &trace_count, 1, &written);
+	f_write(&trace_fd, trace_events, trace_count, &written);
+	f_write(&trace_fd, trace_ticks, trace_count * 4, &written);
+	f_sync(&trace_fd);
+	trace_count = 0;
+	trace_dumping = 0;
+}
+#else
+#define trace(event)
+#define trace_setup()
+#define trace_open(time)
+#define trace_dump()
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 //                                                                           //
 // Low level memory card driver, supports MMC (untested) SDSC, SDHC, and     //
@@ -119,6 +495,19 @@ uint8_t sd_get_r1() {
 	}
 }
 
+// Wait for the start token of a data block. Data usualy follows quickly, so
+// this polls the card as fast as the bus allows instead of pacing like
+// sd_get_r1().
+uint8_t sd_get_token() {
+	uint32_t count = 0;
+	while (1) {
+		uint8_t token = sd_xfer(0xff);
+		if (token != 0xFF) return token;
+		if (count > 200000) sd_timeout();
+		count++; 
+	}
+}
+
 // Returns 1 if a valid, error free response is given, 0 on errors or timeout.
 // This is mostly used for checking the card's compatability.
 uint8_t sd_check_r1() {
@@ -145,15 +534,87 @@ void sd_command(uint8_t cmd, uint32_t arg, uint8_t crc) {
 	sd_xfer(crc|0x01);
 }
 
+// SPI clock settings, fastest first: F_CPU/2, /4, /8, /16, /32, /64 and /128. 
+// The last one is used during initialization, which has to be under 400 kHz.
+#define SD_SPEEDS 7
+#define SD_SPEED_INIT (SD_SPEEDS - 1)
+const uint8_t sd_speed_ctrla[SD_SPEEDS] = {
+	0x1 << 4 | 0x0 << 1, // CLK2X, Div/4
+	0x0 << 4 | 0x0 << 1, // Div/4
+	0x1 << 4 | 0x1 << 1, // CLK2X, Div/16
+	0x0 << 4 | 0x1 << 1, // Div/16
+	0x1 << 4 | 0x2 << 1, // CLK2X, Div/64
+	0x0 << 4 | 0x2 << 1, // Div/64
+	0x0 << 4 | 0x3 << 1, // Div/128
+};
+
+// Current speed, and the fastest one that has worked without errors.
+// The limit is kept across reinitialization, so a card with flaky wiring
+// only has to fail once.
+uint8_t sd_speed = SD_SPEED_INIT;
+uint8_t sd_speed_limit = 0;
+
+void sd_set_speed(uint8_t speed) {
+	sd_speed = speed;
+	SPI0.CTRLA = 1 << 5 | sd_speed_ctrla[speed] | 1; // SPI: Master, enabled
+}
+
+// Drop the clock one step after a transfer error, returns 0 if there's 
+// nothing slower to try.
+uint8_t sd_slow_down() {
+	if (sd_speed >= SD_SPEED_INIT) return 0;
+	sd_speed_limit = sd_speed + 1;
+	sd_set_speed(sd_speed_limit);
+	return 1;
+}
+
+// Read the maximum clock from the card's CSD register (TRAN_SPEED), and 
+// switch to the fastest setting under it.
+void sd_negotiate_speed() {
+	// Mantissa (x10) and exponent (kHz) of the TRAN_SPEED field
+	const uint8_t mantissa[16] = {0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80};
+	const uint32_t exponent[8] = {100, 1000, 10000, 100000, 0, 0, 0, 0};
+
+	// CMD9: Send CSD, which comes back as a 16 byte data block.
+	uint8_t CSD[16];
+	sd_command(9, 0, 0);
+	if (sd_get_r1()) return;
+	if (sd_get_token() != 0xfe) return;
+	for (int i = 0; i < 16; i++) CSD[i] = sd_xfer(0xff);
+	sd_xfer(0xff); sd_xfer(0xff); // CRC
+
+	uint32_t max_khz = exponent[CSD[3] & 0x7] * mantissa[(CSD[3] >> 3) & 0xf] / 10;
+	
+	uint8_t speed = sd_speed_limit;
+	while (speed < SD_SPEED_INIT && (F_CPU / 1000 >> (speed + 1)) > max_khz) speed++;
+	sd_set_speed(speed);
+}
+
+// Card type, found during initialization
+uint8_t sd_powered = 0;
+uint8_t sd_is_mmc = 0;
+uint8_t sd_is_byte_addressed = 0;
+
+// Convert a block number into a command argument. Byte addressed cards (SDSC
+// and MMC) still want a byte offset after the block size is set with CMD16.
+uint32_t sd_address(uint32_t sector) {
+	if (sd_is_byte_addressed) return sector << 9;
+	return sector;
+}
+
 // Mostly universal initization function, configures the card to use 512 byte blocks
 // if it doesn't already.
 void sd_init() {
 	uint8_t is_v2 = 0, is_byte_addressed = 0;
+	sd_is_mmc = 0;
+	trace(TRACE_SD_INIT);
 
 	PORTA.DIRSET = 1 << 4 | 1 << 5 | 1 << 6 | 1 << 7; 
+	sd_set_speed(SD_SPEED_INIT);
 	PORTC.OUTCLR = PORTC_E_CARD; // Do a power cycle to ensure a known state.
 	_delay_ms(10);
 	PORTC.OUTSET = PORTC_E_CARD;
+	energy_card(1);
 	_delay_ms(10);
 	PORTA.OUTSET = PORTA_CS;
 	_delay_ms(10);
@@ -201,6 +662,7 @@ void sd_init() {
 		if (!sd_check_r1()) {
 			// If ACMD 41 failed, the card only supports MMC
 			// Initilization has to be done with CMD1.
+			sd_is_mmc = 1;
 			while (!done) {
 				sd_command(1, 0x0, 0);
 				if (sd_get_r1() == 0x01) {
@@ -223,7 +685,7 @@ void sd_init() {
 
 	// Some V2 cards use byte addressing, we have to check.
 	if (is_v2) {	
-		sd_command(48, 0x0, 0x65);	
+		sd_command(58, 0x0, 0x65);	
 		sd_get_r1(); // First byte is reserved
 		uint8_t OCR[4];
 		OCR[0] = sd_xfer(0xFF);
@@ -232,8 +694,9 @@ void sd_init() {
 		OCR[3] = sd_xfer(0xFF);
 		sd_xfer(0xFF); // Final byte is reseved
 		// Bit 30 of the OCR is set for block addressed cards (HC/XC)
-		is_byte_addressed = !(OCR[0] >> 6) & 1;
+		is_byte_addressed = !((OCR[0] >> 6) & 1);
 	}
+	sd_is_byte_addressed = is_byte_addressed;
 
 	// If the card supports byte addressing, set the block size to 512 for
 	// consitancy with the always block addressed cards (SDHC and higher)
@@ -241,40 +704,127 @@ void sd_init() {
 		sd_command(16, 0x200, 0x0);
 		sd_get_r1();
 	}
+
+	// Initialization is done, switch to a faster clock for data transfer.
+	sd_negotiate_speed();
+	sd_powered = 1;
+	trace(TRACE_SD_INIT | TRACE_END);
 }
 
 // Disconnect power from the SD card to improve battery life.
 void sd_power_off() {
+	trace(TRACE_POWER_OFF);
 	// Make sure the card has time to finish operations
 	for (int i = 0; i < 10; i++) sd_xfer(0xFF);
 	_delay_ms(5); // T
 
 //	TODO FIXME	
 	PORTC.OUTCLR = PORTC_E_CARD;
+	energy_card(0);
+	sd_powered = 0;
+	trace(TRACE_POWER_OFF | TRACE_END);
 //	_delay_ms(1);
 //	PORTA.DIRCLR = 1 << 4 | 1 << 5 | 1 << 6 | 1 << 7; 
 }
 
-// Low level read and write primitives
-void read_block(uint8_t* buff, uint32_t sector) {
+// Readings since the card was last powered off
+int32_t sd_sleeping_readings = 0;
+
+// Get the card ready for a write. If it was left powered it's still 
+// initialized, and only has to be selected again.
+void sd_wake() {
+	if (!sd_powered) {
+		sd_init();
+		return;
+	}
+	PORTA.OUTCLR = PORTA_CS;
+	sd_xfer(0xff);
+}
+
+// Done with the card for now. Deselected cards drop into a low power idle
+// state on their own, so the card is only powered off every
+// card_sleep_readings writes, which skips the slow power cycle and 
+// initialization in between. Continuous bursts keep it powered, see
+// burst_mode.
+void sd_sleep() {
+	sd_sleeping_readings++;
+	if (sd_sleeping_readings > card_sleep_readings && burst_mode != 2) {
+		sd_sleeping_readings = 0;
+		sd_power_off();
+		return;
+	}
+
+	// Deselect, and give the card some clocks to release the data line.
+	while (sd_xfer(0xff) == 0x00) ; 
+	PORTA.OUTSET = PORTA_CS;
+	sd_xfer(0xff);
+}
+
+// Wait for the card to release the data line, after it's done programing
+void sd_wait_ready() {
+	trace(TRACE_BUSY);
+	uint64_t start = rtc_now();
+	while (sd_xfer(0xff) == 0x00) ; 
+	energy.card_busy += rtc_now() - start;
+	trace(TRACE_BUSY | TRACE_END);
+}
+
+// Low level read and write primitives. These return 0 on success, and 1 if
+// the card sent back something unexpected, which is usualy caused by running
+// the bus faster than the wiring can handle.
+uint8_t read_block(uint8_t* buff, uint32_t sector) {
 	// Send read command
-	sd_command(17, sector, 0);
-	sd_get_r1();
+	sd_command(17, sd_address(sector), 0);
+	if (sd_get_r1()) return 1;
 	
 	// Recieve data
-	if (sd_get_r1() != 0xfe) sd_timeout();
+	if (sd_get_token() != 0xfe) return 1;
 	for (int i = 0; i < 512; i++) {
 		buff[i] = sd_xfer(0xff);
 	}
 	
 	// Discard the CRC
 	sd_xfer(0xff); sd_xfer(0xff);
+	return 0;
 }
 
-void write_block(uint8_t* buff, uint32_t sector) {
-	// Send write command
-	sd_command(24, sector, 0);
+// Read a run of consecutive blocks with a single CMD18, the card streams
+// blocks back to back until stopped with CMD12.
+uint8_t read_blocks(uint8_t* buff, uint32_t sector, uint16_t count) {
+	uint8_t error = 0;
+
+	// Send read command
+	sd_command(18, sd_address(sector), 0);
+	if (sd_get_r1()) return 1;
+
+	for (uint16_t n = 0; n < count; n++) {
+		// Recieve data
+		if (sd_get_token() != 0xfe) {
+			error = 1;
+			break;
+		}
+		for (int i = 0; i < 512; i++) {
+			buff[i] = sd_xfer(0xff);
+		}
+		buff += 512;
+		
+		// Discard the CRC
+		sd_xfer(0xff); sd_xfer(0xff);
+	}
+
+	// Stop the transfer. The byte right after CMD12 is junk, and the card
+	// may be busy for a bit after responding.
+	sd_command(12, 0, 0);
+	sd_xfer(0xff);
 	sd_get_r1();
+	while (sd_xfer(0xff) == 0x00) ; 
+	return error;
+}
+
+uint8_t write_block(uint8_t* buff, uint32_t sector) {
+	// Send write command
+	sd_command(24, sd_address(sector), 0);
+	if (sd_get_r1()) return 1;
 	
 	// Give it some time before sending data
 	sd_xfer(0xff); 
@@ -290,9 +840,63 @@ void write_block(uint8_t* buff, uint32_t sector) {
 	// Send dummy CRC
 	sd_xfer(0xff); sd_xfer(0xff);
 
-	// Wait for completion
-	sd_get_r1();
-	while (sd_xfer(0xff) == 0x00) ; 
+	// Wait for completion, the data response is xxx00101 if the block
+	// was accepted.
+	uint8_t response = sd_get_r1();
+	sd_wait_ready();
+	return (response & 0x1f) != 0x05;
+}
+
+// Ask SD cards to pre-erase the blocks of a multiblock write (ACMD23),
+// which lets them skip the read-modify-write of partialy written erase blocks. 
+#define SD_PRE_ERASE 1
+
+// Write a run of consecutive blocks with a single CMD25. The command and the
+// final busy wait are only done once, instead of once per block.
+uint8_t write_blocks(const uint8_t* buff, uint32_t sector, uint16_t count) {
+	uint8_t error = 0;
+
+	if (SD_PRE_ERASE && !sd_is_mmc) {
+		sd_command(55, 0, 0);
+		sd_get_r1();
+		sd_command(23, count, 0);
+		sd_get_r1();
+	}
+
+	// Send write command
+	sd_command(25, sd_address(sector), 0);
+	if (sd_get_r1()) return 1;
+	
+	// Give it some time before sending data
+	sd_xfer(0xff); 
+
+	for (uint16_t n = 0; n < count; n++) {
+		// Send the multiblock start token
+		sd_xfer(0b11111100);
+		
+		// Send the data
+		for (int i = 0; i < 0x200; i++) {
+			sd_xfer(buff[i]);
+		}
+		buff += 0x200;
+
+		// Send dummy CRC
+		sd_xfer(0xff); sd_xfer(0xff);
+
+		// The card stays busy while it takes in the block
+		uint8_t response = sd_get_r1();
+		sd_wait_ready();
+		if ((response & 0x1f) != 0x05) {
+			error = 1;
+			break;
+		}
+	}
+
+	// Send the stop token and wait for the card to finish programing 
+	sd_xfer(0b11111101);
+	sd_xfer(0xff);
+	sd_wait_ready();
+	return error;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -304,23 +908,31 @@ void write_block(uint8_t* buff, uint32_t sector) {
 // We'll manualy initialize the card before mounting
 DSTATUS disk_initialize (BYTE pdrv) {return 0;}
 
-// Multiblock read. We don't care about speed, so using a bunch of single
-// block commands is just fine.
+// Multiblock read. Runs of more than one block are streamed with CMD18
+// instead of paying for a command per block.
+// Transfer errors drop the bus speed a step and retry, until the card is 
+// back at the initialization clock. 
 DRESULT disk_read (BYTE drive, BYTE* buff, LBA_t sector, UINT count) {
-	for (int i = 0; i < count; i++) {
-		read_block(&buff[512*i], sector + i);
+	while (1) {
+		uint8_t error;
+		if (count == 1) error = read_block(buff, sector);
+		else error = read_blocks(buff, sector, count);
+		if (!error) return 0;
+		if (!sd_slow_down()) sd_timeout();
 	}
-	return 0;
 };
 
 
-// Multiblock write. We don't care about speed, so using a bunch of single
-// block commands is just fine.
+// Multiblock write. Runs of more than one block go out as a single CMD25
+// so the card only has to do one command and busy handshake.
 DRESULT disk_write (BYTE drive, const BYTE* buff, LBA_t sector, UINT count) {
-	for (int i = 0; i < count; i++) {
-		write_block(&buff[0x200*i], sector);
+	while (1) {
+		uint8_t error;
+		if (count == 1) error = write_block((uint8_t*)buff, sector);
+		else error = write_blocks(buff, sector, count);
+		if (!error) return 0;
+		if (!sd_slow_down()) sd_timeout();
 	}
-	return 0;
 };
 
 // This function tells the library the block size for reading (SECTOR_SIZE)
@@ -336,10 +948,574 @@ DSTATUS disk_status (BYTE pdrv) {
 	return 0; 
 }
 
-// Without an RTC, we have no way of knowing the real time, so 
-// just use an blatantly bogus date (1980)
+// Timestamps for the directory entries, from the RTC. If the time was
+// never set, it comes out as a blatantly bogus date (1980).
 DWORD get_fattime (void) {
-	return 0; // don't have a clock :(
+	uint32_t time = time_now(0);
+	if (time < 315532800) return 0; // Before 1980
+
+	// Days since 1970 to a date, see "civil_from_days" by Howard Hinnant
+	uint32_t days = time / 86400 + 719468;
+	uint32_t seconds = time % 86400;
+	uint32_t era = days / 146097;
+	uint32_t day_of_era = days - era * 146097;
+	uint32_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+	uint32_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+	uint32_t month = (5 * day_of_year + 2) / 153; // From March
+	uint32_t day = day_of_year - (153 * month + 2) / 5 + 1;
+	uint32_t year = year_of_era + era * 400;
+	if (month < 10) {
+		month += 3;
+	} else {
+		month -= 9;
+		year++;
+	}
+
+	return (year - 1980) << 25 | month << 21 | day << 16 
+		| (seconds / 3600) << 11 | (seconds / 60 % 60) << 5 | (seconds % 60) / 2;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// Binary log format. The file is a sequence of self contained 512 byte     //
+// blocks, one per sector:                                                  //
+//                                                                          //
+//   0   uint16  Magic, 0x4746 ("FG")                                       //
+//   2   uint8   Block type                                                 //
+//   3   uint8   Number of records in the block                             //
+//   4   ...     Payload                                                    //
+//   510 uint16  CRC-16/CCITT (0x1021, init 0xFFFF) of bytes 0-509          //
+//                                                                          //
+// All fields are little endian.                                            //
+//                                                                          //
+// A block of readings that isn't full is written again with the next      //
+// batch, until it is, so each batch doesn't take up a whole block.         //
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+
+#define BLOCK_MAGIC 0x4746
+#define BLOCK_PAYLOAD 506
+
+// Written on startup: int32 Tlog, int32 OSR, int32 burst mode, 
+// int16 Vdiv, int16 Vamp, int16 Vdiff, uint8 self test failed,
+// uint8 ADC accumulation (log2), int16 half-cycles per sample, 
+// uint32 Unix time, uint8 1 if this starts a new file of a rotated log 
+// rather than a restart
+#define BLOCK_HEADER 1
+// No longer written: count * (uint32 counter, int32 reading)
+#define BLOCK_READINGS 2
+// No longer written: uint32 counter, uint16 index of the first sample,
+// uint16 total samples, then count * int16 samples.
+#define BLOCK_BURST 3
+// No longer written: count * (uint32 counter, int64 reading, uint16 
+// saturated half-cycles)
+#define BLOCK_READINGS64 4
+// No longer written: uint32 counter, uint16 index of the first sample, 
+// uint16 total samples, uint16 saturated half-cycles, count * int32 samples
+#define BLOCK_BURST32 5
+// count * (uint32 counter, uint32 Unix time, uint16 ms, uint16 saturated 
+// half-cycles, int64 reading)
+#define BLOCK_READINGS_TIMED 6
+// uint32 counter, uint32 Unix time, uint16 ms, uint16 index of the first
+// sample, uint16 total samples in the burst, uint16 saturated half-cycles,
+// then count * int32 samples. Long bursts are split over blocks.
+#define BLOCK_BURST_TIMED 7
+// Same as BLOCK_BURST_TIMED up to the saturated half-cycles, then uint16 
+// samples in the block (the count in the block header is 0), uint8 Rice
+// parameter k, int32 first sample, then the differences between the
+// samples that follow, Rice coded. See write_burst_rice().
+#define BLOCK_BURST_RICE 8
+// uint32 Unix time, uint64 RTC ticks elapsed, in standby, idle, with the
+// sensor powered, with the card powered, with the card busy, uint32 
+// readings. See write_energy()
+#define BLOCK_ENERGY 9
+
+uint8_t log_block[512];
+uint16_t log_block_len;
+
+uint16_t crc16(const uint8_t* data, uint16_t len) {
+	uint16_t crc = 0xffff;
+	for (uint16_t i = 0; i < len; i++) {
+		crc ^= (uint16_t)data[i] << 8;
+		for (uint8_t bit = 0; bit < 8; bit++) {
+			if (crc & 0x8000) crc = crc << 1 ^ 0x1021;
+			else crc <<= 1;
+		}
+	}
+	return crc;
+}
+
+void block_start(uint8_t type) {
+	for (uint16_t i = 0; i < 512; i++) log_block[i] = 0;
+	log_block[0] = (uint8_t)BLOCK_MAGIC;
+	log_block[1] = BLOCK_MAGIC >> 8;
+	log_block[2] = type;
+	log_block_len = 4;
+}
+
+// Append a value to the block, the AVR is little endian, so the bytes 
+// can be copied as is.
+void block_put(const void* data, uint16_t size) {
+	for (uint16_t i = 0; i < size; i++) {
+		log_block[log_block_len++] = ((const uint8_t*)data)[i];
+	}
+}
+
+// Fill in the record count and checksum, and write the block to the log.
+void block_write(uint8_t count) {
+	UINT written;
+	log_block[3] = count;
+	uint16_t crc = crc16(log_block, 510);
+	log_block[510] = (uint8_t)crc;
+	log_block[511] = crc >> 8;
+	if (log_write_sector()) return;
+	f_write(&fd, log_block, 512, &written);
+}
+
+// Time of the last record in a binary log block, or 0
+uint32_t block_last_time() {
+	uint8_t count = log_block[3];
+	if (log_block[0] != (uint8_t)BLOCK_MAGIC || log_block[1] != BLOCK_MAGIC >> 8) return 0;
+	if (crc16(log_block, 510) != (log_block[510] | (uint16_t)log_block[511] << 8)) return 0;
+
+	uint8_t* time = 0;
+	if (log_block[2] == BLOCK_READINGS_TIMED && count) time = &log_block[4 + (count - 1) * 20 + 4];
+	if (log_block[2] == BLOCK_BURST_TIMED || log_block[2] == BLOCK_BURST_RICE) time = &log_block[8];
+	if (log_block[2] == BLOCK_HEADER) time = &log_block[26];
+	if (log_block[2] == BLOCK_ENERGY) time = &log_block[4];
+	if (!time) return 0;
+	return time[0] | (uint32_t)time[1] << 8 | (uint32_t)time[2] << 16 | (uint32_t)time[3] << 24;
+}
+
+// Time of the last timestamp in a chunk of the CSV log, or 0. Timestamps
+// are the only numbers with a decimal point: ",<seconds>.<ms>\n".
+uint32_t text_last_time(uint16_t len) {
+	for (uint16_t i = len; i-- > 0; ) {
+		if (log_block[i] != '.' || i + 4 >= len || log_block[i + 4] != '\n') continue;
+		uint16_t start = i;
+		while (start > 0 && log_block[start - 1] >= '0' && log_block[start - 1] <= '9') start--;
+		if (start == i || start == 0 || log_block[start - 1] != ',') continue;
+
+		uint32_t time = 0;
+		for (uint16_t j = start; j < i; j++) time = time * 10 + log_block[j] - '0';
+		return time;
+	}
+	return 0;
+}
+
+// CSV lines are formatted straight into log_block, which goes to f_write()
+// whenever it reaches a sector boundary of the file, instead of going 
+// through f_printf() a character at a time. FatFs writes whole, aligned
+// sectors to the card without copying them.
+uint16_t text_len;
+uint16_t text_end; // Where the file gets to the next sector boundary
+
+void text_flush() {
+	UINT written;
+	f_write(&fd, log_block, text_len, &written);
+	text_len = 0;
+	text_end = 512 - fd.fptr % 512;
+}
+
+void text_start() {
+	text_len = 0;
+	text_end = 512 - fd.fptr % 512;
+}
+
+void text_char(char c) {
+	log_block[text_len++] = c;
+	if (text_len == text_end) text_flush();
+}
+
+void text_string(const char* s) {
+	while (*s) text_char(*s++);
+}
+
+// Digits are found by subtracting powers of ten, the AVR has no divide
+// instruction, and dividing in software takes hundreds of cycles per digit.
+const uint32_t powers_of_ten[10] = {
+	1000000000, 100000000, 10000000, 1000000, 100000, 10000, 1000, 100, 10, 1
+};
+
+// Write a number with at least digits digits, zero padded
+void text_uint(uint32_t value, uint8_t digits) {
+	for (uint8_t i = 0; i < 10; i++) {
+		char digit = '0';
+		while (value >= powers_of_ten[i]) {
+			value -= powers_of_ten[i];
+			digit++;
+		}
+		if (digit != '0' || 10 - i <= digits) {
+			text_char(digit);
+			digits = 10;
+		}
+	}
+}
+
+void text_uint64(uint64_t value) {
+	if (value >> 32) {
+		text_uint64(value / 1000000000);
+		text_uint(value % 1000000000, 9);
+	} else {
+		text_uint(value, 1);
+	}
+}
+
+void text_int(int64_t value) {
+	if (value < 0) text_char('-');
+	text_uint64(value < 0 ? -(uint64_t)value : (uint64_t)value);
+}
+
+// Unix time as seconds.milliseconds
+void text_time(uint32_t time, uint16_t ms) {
+	text_uint(time, 1);
+	text_char('.');
+	text_uint(ms, 3);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// Log file. A new log is preallocated as one contiguous run of clusters,   //
+// so FatFs never has to allocate clusters and update the FAT while         //
+// logging. Binary blocks are then written straight to their sectors, and   //
+// the file size in the directory entry is only brought up to date every    //
+// LOG_SIZE_INTERVAL sectors, or LOG_SIZE_SECONDS if that comes first, so   //
+// slow logs show up on a PC too. Blocks written since are found again on   //
+// startup by reading on from the end of the file.                          //
+//                                                                          //
+// Opening a file for appending makes FatFs follow the cluster chain from   //
+// the start of the file, one FAT entry at a time, which takes a long time  //
+// once the log is big. Instead, the position of the last few sectors of    //
+// the log (LOG_TAIL) is saved on startup, and the next startup carries on  //
+// from there.                                                              //
+//                                                                          //
+// A rotated log is a numbered series of files. The number of the current   //
+// one is kept in FLUXGATE.STA, so it's found without a directory scan.     //
+// Without it, a restart starts a new file after the last one there is.     //
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+
+#define LOG_SIZE_INTERVAL 64
+#define LOG_SIZE_SECONDS 600
+#define LOG_TAIL 8192
+
+// FLUXGATE.STA, information about the log that can't be read back from the
+// file system, kept across restarts.
+#define STATE_MAGIC 0x41545346 // "FSTA"
+typedef struct {
+	uint32_t magic;
+	uint32_t log_cluster; // First cluster of the log
+	uint32_t log_capacity; // Sectors preallocated, 0 if not preallocated
+	uint32_t tail_position; // File position near the end of the log
+	uint32_t tail_cluster; // Cluster that position is in (FIL.clust)
+	uint32_t log_number; // Current file of a rotated log, 0 for the first
+	uint32_t log_size; // Size of the log when the tail was saved
+	uint32_t tail_check; // crc16() of the sector at the tail position
+} state_t;
+
+state_t state;
+
+uint32_t log_time; // Last time found in the log on startup
+
+uint32_t log_sector; // Sector of the start of the log
+uint32_t log_capacity; // Sectors that can be written directly, 0 if none
+uint32_t log_sectors; // Sectors written so far
+uint64_t log_sized_at; // RTC ticks when the file size was last updated
+uint32_t log_readings; // Readings written to the file since it was opened
+FSIZE_t log_checked_size; // Size of the file when log_full() last checked it
+
+void state_read() {
+	FIL file;
+	UINT len;
+	if (f_open(&file, "FLUXGATE.STA", FA_READ)) return;
+	f_read(&file, &state, sizeof(state), &len);
+	f_close(&file);
+	if (len != sizeof(state) || state.magic != STATE_MAGIC) {
+		state_t empty = {0};
+		state = empty;
+	}
+}
+
+void state_write() {
+	FIL file;
+	UINT len;
+	state.magic = STATE_MAGIC;
+	if (f_open(&file, "FLUXGATE.STA", FA_WRITE | FA_OPEN_ALWAYS)) return;
+	f_write(&file, &state, sizeof(state), &len);
+	f_close(&file);
+}
+
+// Read a FAT entry straight from the card, using log_block
+uint32_t fat_entry(uint32_t cluster) {
+	if (fs.fs_type == FS_FAT32) {
+		disk_read(0, log_block, fs.fatbase + cluster / 128, 1);
+		uint8_t* entry = &log_block[cluster % 128 * 4];
+		return (entry[0] | (uint32_t)entry[1] << 8 | (uint32_t)entry[2] << 16 | (uint32_t)entry[3] << 24) & 0x0FFFFFFF;
+	}
+	if (fs.fs_type == FS_FAT16) {
+		disk_read(0, log_block, fs.fatbase + cluster / 256, 1);
+		uint8_t* entry = &log_block[cluster % 256 * 2];
+		return entry[0] | (uint16_t)entry[1] << 8;
+	}
+	return 0; // FAT12 entries can straddle sectors, not worth it
+}
+
+// crc16() of the sector at the file position, which stays where it is
+uint32_t log_tail_check() {
+	FSIZE_t position = fd.fptr;
+	DWORD cluster = fd.clust;
+	UINT len;
+	if (f_read(&fd, log_block, 512, &len) || len != 512) len = 0;
+	fd.fptr = position;
+	fd.clust = cluster;
+	return len ? crc16(log_block, 512) : 0;
+}
+
+// Carry on from the saved tail position, if it's still good: same first
+// cluster, no shorter than when the tail was saved, in a cluster that's in
+// use, and with the same data there. The file could have been replaced on
+// a PC by one that happens to start in the same cluster. Otherwise FatFs 
+// walks the chain from the start, like for any other file.
+void log_seek_tail() {
+	if (state.magic == STATE_MAGIC && state.log_cluster == fd.obj.sclust 
+		&& state.tail_position && state.tail_position < state.log_size
+		&& state.log_size <= f_size(&fd)
+		&& state.tail_cluster >= 2 && state.tail_cluster < fs.n_fatent
+		&& fat_entry(state.tail_cluster) != 0) {
+		fd.fptr = state.tail_position;
+		fd.clust = state.tail_cluster;
+		if (log_tail_check() != state.tail_check) {
+			fd.fptr = 0;
+			fd.clust = 0;
+		}
+	}
+
+	FSIZE_t tail = f_size(&fd) > LOG_TAIL ? (f_size(&fd) - LOG_TAIL) & ~511UL : 0;
+	if (tail >= fd.fptr) f_lseek(&fd, tail);
+}
+
+// Read through the rest of the log, leaving the file position at the end,
+// and note the last time in it.
+void log_read_tail() {
+	UINT len = 0;
+	uint16_t kept = 0;
+	do {
+		uint32_t time;
+		if (log_format) {
+			f_read(&fd, log_block, 512, &len);
+			time = len == 512 ? block_last_time() : 0;
+		} else {
+			// Keep the end of the last chunk, in case a timestamp is split
+			uint16_t total = kept + len;
+			kept = total < 16 ? total : 16;
+			for (uint16_t i = 0; i < kept; i++) log_block[i] = log_block[total - kept + i];
+			f_read(&fd, log_block + kept, 512 - kept, &len);
+			time = text_last_time(kept + len);
+		}
+		if (time) log_time = time;
+	} while (len);
+}
+
+// Bring the file size in the directory entry up to date
+void log_update_size() {
+	f_lseek(&fd, log_sectors * 512); // Moving past the end extends the file
+	f_sync(&fd);
+	log_sized_at = rtc_now();
+}
+
+// Write log_block to the next sector of a preallocated log, returns 0 if
+// the log isn't preallocated or is full, so it has to go through FatFs.
+// A failed write sets the file's error, the same as f_write() does, so 
+// nothing more is written to the log until the next startup.
+uint8_t log_write_sector() {
+	if (log_sectors >= log_capacity) return 0;
+	if (fd.err) return 1;
+	if (disk_write(0, log_block, log_sector + log_sectors, 1) != RES_OK) {
+		fd.err = FR_DISK_ERR;
+		return 1;
+	}
+	log_sectors++;
+	// Not again when the same sector is written again (log_rewind())
+	if ((FSIZE_t)log_sectors * 512 <= f_size(&fd)) return 1;
+	if (log_sectors % LOG_SIZE_INTERVAL == 0 || log_sectors == log_capacity
+		|| rtc_now() - log_sized_at >= LOG_SIZE_SECONDS * RTC_HZ) log_update_size();
+	return 1;
+}
+
+// Step back over the last block written, to write it again. Direct writes
+// go on from log_sectors, until the preallocated space is full. After 
+// that, FatFs writes at the file position, which the last size update 
+// left at the end of the direct writes.
+void log_rewind() {
+	if (log_sectors < log_capacity) log_sectors--;
+	else f_lseek(&fd, fd.fptr - 512);
+}
+
+// Find blocks written after the last size update. They have to check out,
+// and go forward in time, so whatever was in the preallocated clusters 
+// before isn't mistaken for part of the log.
+void log_recover() {
+	for (uint8_t i = 0; i < LOG_SIZE_INTERVAL && log_sectors < log_capacity; i++) {
+		disk_read(0, log_block, log_sector + log_sectors, 1);
+		uint32_t time = block_last_time();
+		if (!time || time < log_time) break;
+		log_time = time;
+		log_sectors++;
+	}
+	log_update_size();
+}
+
+// The preallocated clusters still belong to the log: the last one ends the
+// chain, and the one before it links to it. The directory entry only covers
+// what has been written, so a disk checker (chkdsk, fsck) sees the rest as
+// lost clusters, and may free them or cut the chain at the file size. Not 
+// checked on FAT12, so no direct writes there.
+uint8_t log_allocated() {
+	uint32_t clusters = (state.log_capacity + fs.csize - 1) / fs.csize;
+	uint32_t last = state.log_cluster + clusters - 1;
+	if (state.log_cluster < 2 || last >= fs.n_fatent) return 0;
+	uint32_t end = fat_entry(last);
+	if (fs.fs_type == FS_FAT16 ? end < 0xFFF8 : end < 0x0FFFFFF8) return 0;
+	return clusters < 2 || fat_entry(last - 1) == last;
+}
+
+// Size of the log file, including sectors written directly since the size
+// in the directory entry was last updated
+FSIZE_t log_size() {
+	return log_capacity ? (FSIZE_t)log_sectors * 512 : f_size(&fd);
+}
+
+// Open the log for appending, preallocating it if it's new.
+void log_open(const char* name) {
+	uint8_t created = 0;
+	log_capacity = log_sectors = log_readings = 0;
+	if (f_open(&fd, name, FA_READ | FA_WRITE | FA_OPEN_ALWAYS)) sd_timeout();
+
+	if (fd.obj.sclust == 0 && preallocate) { // New, nothing allocated yet
+		if (f_expand(&fd, (FSIZE_t)preallocate << 20, 1) == FR_OK) {
+			// f_expand sets the size to all of the space, but the log
+			// should only be as long as what's been written. So the 
+			// directory entry is shorter than the cluster chain, until the
+			// log fills it. Disk checkers report the rest as lost clusters,
+			// which log_allocated() catches if they were freed.
+			fd.obj.objsize = 0;
+			f_sync(&fd);
+			created = 1;
+			// The clusters may still hold an old log. Clear the first
+			// sectors, so its blocks aren't taken for ones written since 
+			// the last size update (log_recover()) while this log is
+			// still empty, with no time to compare them against.
+			if (log_format) {
+				for (uint16_t i = 0; i < 512; i++) log_block[i] = 0;
+				for (uint8_t i = 0; i < LOG_SIZE_INTERVAL; i++) {
+					disk_write(0, log_block, fs.database + (fd.obj.sclust - 2) * fs.csize + i, 1);
+				}
+			}
+			state.magic = STATE_MAGIC;
+			state.log_cluster = fd.obj.sclust;
+			state.log_capacity = (uint32_t)preallocate << 11;
+			state.tail_position = 0;
+			state_write();
+		}
+	}
+
+	log_seek_tail();
+	if (fd.fptr && fd.fptr != state.tail_position) {
+		// Save where the tail starts now for next time
+		if (state.log_cluster != fd.obj.sclust) state.log_capacity = 0;
+		state.log_cluster = fd.obj.sclust;
+		state.tail_position = fd.fptr;
+		state.tail_cluster = fd.clust;
+		state.log_size = f_size(&fd);
+		state.tail_check = log_tail_check();
+		state_write();
+	}
+	log_read_tail();
+
+	// Direct writes only for binary logs, which are written whole sectors 
+	// at a time, into the space preallocated for this log, if it's still
+	// there. Otherwise FatFs carries on, and allocates clusters as needed.
+	if (log_format && state.log_capacity && state.log_cluster == fd.obj.sclust && log_allocated()) {
+		log_sector = fs.database + (state.log_cluster - 2) * fs.csize;
+		log_capacity = state.log_capacity;
+		log_sectors = f_size(&fd) / 512;
+		// Nothing to find in a new log. Otherwise blocks have to be after
+		// the last time in the log, or at the start of an empty one, 
+		// which was cleared when it was created.
+		if (!created && (log_time || !log_sectors)) log_recover();
+	}
+	log_checked_size = log_size();
+}
+
+// The log is split over numbered files
+uint8_t log_rotating() {
+	return rotate_size || rotate_readings;
+}
+
+// Name of a file of the log: /FG<number + 1>.CSV/BIN, so they count from 1
+void log_name(char* name, uint32_t number) {
+	const char* pattern = log_format ? "/FG000000.BIN" : "/FG000000.CSV";
+	for (uint8_t i = 0; i < 14; i++) name[i] = pattern[i];
+	number++;
+	for (uint8_t i = 8; number; i--) {
+		name[i] = '0' + number % 10;
+		number /= 10;
+	}
+}
+
+// Open the current file of the log
+void log_open_current() {
+	char name[14];
+	log_name(name, state.log_number);
+	log_open(name);
+}
+
+// A file is full once another write as big as the last one wouldn't fit,
+// so files stay within the preallocated space.
+uint8_t log_full() {
+	FSIZE_t size = log_size();
+	FSIZE_t written = size - log_checked_size;
+	log_checked_size = size;
+	if (rotate_size && size + written > (FSIZE_t)rotate_size << 20) return 1;
+	if (rotate_readings && log_readings >= (uint32_t)rotate_readings) return 1;
+	return 0;
+}
+
+// Close the current file and move on to the next one. Everything about the
+// old file is dropped from the state, which is saved with the new number.
+void log_next() {
+	if (log_capacity) log_update_size();
+	f_close(&fd);
+	state_t next = {STATE_MAGIC};
+	next.log_number = state.log_number + 1;
+	state = next;
+	log_open_current();
+	state_write();
+}
+
+// Open the log on startup. Readings are only counted from startup, so when
+// rotating by readings, a restart moves on to a new file.
+void log_start() {
+	state_read();
+	if (!log_rotating()) {
+		log_open(log_format ? "/FLUXGATE.BIN" : "/FLUXGATE.CSV");
+		return;
+	}
+	if (state.magic != STATE_MAGIC) {
+		// FLUXGATE.STA was lost. Whether the last file was closed isn't
+		// known, so start a new one after it, instead of adding to one
+		// that may already be full.
+		char name[14];
+		FIL file;
+		while (log_name(name, state.log_number), f_open(&file, name, FA_READ) == FR_OK) {
+			f_close(&file);
+			state.log_number++;
+		}
+		state_write();
+	}
+	log_open_current();
+	// The file is already full
+	while (log_full() || (rotate_readings && log_size())) log_next();
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -360,11 +1536,45 @@ void adc_setup() {
 }
 
 
+// Self test results, repeated at the start of each file of a rotated log
+int16_t vdiv, vamp, vdiff;
+uint8_t self_test_failed;
+
+void write_self_test(uint8_t restarted) {
+	if (log_format) {
+		// Binary logs get all the startup information in one header block
+		int32_t burst = burst_mode;
+		block_start(BLOCK_HEADER);
+		block_put(&log_interval, 4);
+		block_put(&oversampling_ratio, 4);
+		block_put(&burst, 4);
+		block_put(&vdiv, 2);
+		block_put(&vamp, 2);
+		block_put(&vdiff, 2);
+		block_put(&self_test_failed, 1);
+		block_put(&adc_accumulation, 1);
+		block_put(&integration, 2);
+		uint32_t time = time_now(0);
+		block_put(&time, 4);
+		uint8_t new_file = !restarted;
+		block_put(&new_file, 1);
+		block_write(0);
+	} else {
+		f_printf(&fd, "Vdiv,%d\n", vdiv); 
+		f_printf(&fd, "Vamp,%d\n", vamp); 
+		f_printf(&fd, "Vdiff,%d\n", vdiff); 
+	}
+	
+	// Fluxh file
+	f_sync(&fd);
+}
+
 // Sanity check for the ciruict
 // Measurements are taken multiple times to check for bad (high-z) connections.
 void self_test() {
 	adc_setup();
 	PORTC.OUTSET = PORTC_E_SENSOR;
+	energy_sensor(1);
 	_delay_ms(50);
 
 	// Read voltage divider
@@ -375,8 +1585,7 @@ void self_test() {
 		ADC0.COMMAND = 1;
 		while (ADC0.COMMAND) ;
 	}
-	int16_t vdiv = ADC0.RES;
-	f_printf(&fd, "Vdiv,%d\n", vdiv); 
+	vdiv = ADC0.RES;
 
 	// Read amplifier output
 	VREF.ADC0REF = 1; // 2.048 V reference
@@ -386,8 +1595,7 @@ void self_test() {
 		ADC0.COMMAND = 1;
 		while (ADC0.COMMAND) ;
 	}
-	int16_t vamp = ADC0.RES;
-	f_printf(&fd, "Vamp,%d\n", vamp); 
+	vamp = ADC0.RES;
 	
 	// Read difference
 	VREF.ADC0REF = 1; // 2.048 V reference
@@ -397,59 +1605,176 @@ void self_test() {
 		ADC0.COMMAND = 1;
 		while (ADC0.COMMAND) ;
 	}
-	int16_t vdiff = ADC0.RES;
-	f_printf(&fd, "Vdiff,%d\n", vdiff); 
+	vdiff = ADC0.RES;
 	
 	
 	// Turn off the amplifier
 	PORTC.OUTCLR = PORTC_E_SENSOR;
-	
-	// Fluxh file
-	f_sync(&fd);
+	energy_sensor(0);
 
 	// With a 2.048 volt reference and 2048 bins per vref, the output is will be in mV
 	int32_t expected = 1560; 
-	if (vdiv > (expected + 200) || vdiv < (expected - 200)) self_test_failure();
-	if (vamp > (expected + 200) || vamp < (expected - 200)) self_test_failure();
-	if (vdiff > 50 || vdiff < -50) self_test_failure();
+	self_test_failed = 0;
+	if (vdiv > (expected + 200) || vdiv < (expected - 200)) self_test_failed = 1;
+	if (vamp > (expected + 200) || vamp < (expected - 200)) self_test_failed = 1;
+	if (vdiff > 50 || vdiff < -50) self_test_failed = 1;
+	
+	write_self_test(1);
+
+	if (self_test_failed) self_test_failure();
+}
+
+// Time between drive coil edges. The ADC is started by TCB0 through the 
+// event system, so the excitation and sampling don't depend on how long 
+// the code takes to run.
+#define HALF_CYCLE_US 20
+#define HALF_CYCLE_TICKS (F_CPU / 1000000 * HALF_CYCLE_US)
+
+// One conversion takes 15 (sample delay) + 2 (sampling) + 13 ADC clocks at
+// clk_per/2, rounded up. With hardware accumulation the half-cycle is
+// stretched by this much for each extra conversion, so all of them are done
+// before the coil flips again.
+#define CONVERSION_TICKS 64
+
+// Acquisition state, shared with the interrupts
+int32_t* acq_buffer; // Where samples are being recorded, or 0 to add them up in acq_sum
+int32_t acq_count; // Number of samples to record
+int32_t acq_n; // Number of samples recorded
+int16_t acq_half_cycles; // Number of half-cycles in the current sample
+int32_t acq_accumulator;
+int64_t acq_sum;
+int32_t acq_limit; // Saturation threshold for one half-cycle
+uint16_t acq_saturated; // Saturated half-cycles so far
+volatile uint8_t acq_done;
+
+// Continuous mode alternates between two buffers of acq_count samples each.
+// A full buffer is handed to the main loop through acq_pending, and is
+// dropped (counted in acq_overruns) if the previous one hasn't been written
+// by then.
+uint8_t acq_continuous;
+int32_t* acq_first;
+int32_t* volatile acq_pending;
+uint16_t acq_pending_saturated;
+uint64_t acq_pending_ticks; // RTC ticks when it was filled
+volatile uint16_t acq_overruns;
+
+// Start of each half-cycle: flip the drive coil. The same timer event
+// starts the ADC, which waits out the sample delay so it always sees the
+// new phase.
+ISR(TCB0_INT_vect) {
+	PORTC.OUTTGL = PORTC_DRIVE_COIL;
+	TCB0.INTFLAGS = 1;
+}
+
+// Conversion done, add it to the current sample with the sign of the 
+// drive coil phase it was taken in.
+ISR(ADC0_RESRDY_vect) {
+	int32_t result = (int16_t)ADC0.RES; // Also clears the flag
+	if (PORTC.OUT & PORTC_DRIVE_COIL) result = -result;
+	if (acq_done) return;
+	
+	// Record a sample every integration half-cycles
+	if (acq_half_cycles == integration) {
+		if (acq_buffer) acq_buffer[acq_n] = acq_accumulator;
+		else acq_sum += acq_accumulator;
+		acq_accumulator = 0;
+		acq_half_cycles = 0;
+		acq_n++;
+		if (acq_n >= acq_count) {
+			acq_n = 0;
+			if (!acq_continuous) {
+				acq_done = 1;
+				return;
+			}
+			if (acq_pending) {
+				acq_overruns++; // Overwrite this buffer
+			} else {
+				acq_pending_saturated = acq_saturated;
+				acq_pending_ticks = rtc_read();
+				acq_saturated = 0;
+				acq_pending = acq_buffer;
+				acq_buffer = acq_buffer == acq_first ? acq_first + acq_count : acq_first;
+			}
+		}
+	}
+
+	// Record measurement, skipping the first few while the sensor settles
+	acq_accumulator += result;
+	if (acq_half_cycles < 0) acq_accumulator = 0;
+	else if ((result > acq_limit || result < -acq_limit) && acq_saturated < 0xFFFF) acq_saturated++;
+	acq_half_cycles++;
 }
 
-// Results are stored in burst_buffer
-void measure(int count) {
+// Power up the sensor and start recording count samples into buffer, or
+// adding them up if buffer is 0. In continuous mode, this carries on untill
+// stopped, using twice count samples of buffer.
+void acquisition_start(int32_t* buffer, int32_t count, uint8_t continuous) {
 	PORTC.OUTSET = PORTC_E_SENSOR;
+	energy_sensor(1);
 	adc_setup(); // Reset ADC for 1 volt (.5 mV res) differential mode
 	_delay_ms(10); // Givw the sensor time to start
 	
-	int n = 0; // Number of samples recorded
-	int i = -10; // Number of half-cycles in the current sample	
-	int sign = 1; // Current phase of the drive coil
-	volatile int16_t accumulator = 0;
-
-	while (n < count) {
-		PORTC.OUT ^= PORTC_LED;
-		ADC0.COMMAND = 1;
-		_delay_us(18); 
-		PORTC.OUT ^= PORTC_DRIVE_COIL;
-		
-		// Record samples every 5 cycles
-		if (i == 10) {
-			burst_buffer[n] = accumulator;
-			accumulator = 0;
-			i = 0;
-			n++;
-		}
+	acq_buffer = buffer;
+	acq_first = buffer;
+	acq_count = count;
+	acq_n = 0;
+	acq_half_cycles = -10;
+	acq_accumulator = 0;
+	acq_sum = 0;
+	acq_limit = (int32_t)SATURATION << adc_scale();
+	acq_saturated = 0;
+	acq_done = 0;
+	acq_continuous = continuous;
+	acq_pending = 0;
+	acq_overruns = 0;
+
+	// Start conversions on TCB0 events
+	EVSYS.CHANNEL0 = 0xA0; // TCB0 capture
+	EVSYS.USERADC0START = 0x1; // Event channel 0
+	ADC0.CTRLD = 0xF; // 15 ADC clock sample delay, gives the ISR time to flip the coil
+	ADC0.CTRLB = adc_accumulation; // SAMPNUM: Conversions per start event
+	ADC0.EVCTRL = 0x1; // Start on event
+	ADC0.INTCTRL = 0x1; // Result ready interrupt
+	
+	// TCB0: Periodic interrupt every half-cycle
+	TCB0.CTRLB = 0x0; // Periodic interrupt mode
+	TCB0.CCMP = HALF_CYCLE_TICKS + ((1 << adc_accumulation) - 1) * CONVERSION_TICKS - 1;
+	TCB0.CNT = 0;
+	TCB0.INTCTRL = 0x1; // Capture interrupt
+	TCB0.CTRLA = 0x1; // clk_per, enable
+	PORTC.OUTSET = PORTC_LED;
+}
 
-		// Record measurement
-		accumulator += ADC0.RES * sign;
-		if (i < 0) accumulator = 0;
-		
-		sign *= -1;
-		i++;
-	}
+void acquisition_stop() {
+	TCB0.CTRLA = 0x0;
+	TCB0.INTCTRL = 0x0;
+	ADC0.INTCTRL = 0x0;
+	ADC0.EVCTRL = 0x0;
+	ADC0.CTRLD = 0x0;
+	ADC0.CTRLB = 0x0;
+	EVSYS.USERADC0START = 0x0;
 
 	PORTC.OUTCLR = PORTC_LED;
 	PORTC.OUTCLR = PORTC_DRIVE_COIL;
 	PORTC.OUTCLR = PORTC_E_SENSOR;
+	energy_sensor(0);
+}
+
+// Results are stored in buffer, or added up into acq_sum if buffer is 0
+void measure(int32_t* buffer, int32_t count) {
+	trace(TRACE_MEASURE);
+	acquisition_start(buffer, count, 0);
+
+	// Nothing to do until the interrupts are done
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_enable();
+	uint64_t start = rtc_now();
+	while (!acq_done) sleep_cpu();
+	energy.idle += rtc_now() - start;
+	sleep_disable();
+
+	acquisition_stop();
+	trace(TRACE_MEASURE | TRACE_END);
 }
 
 
@@ -461,45 +1786,354 @@ void measure(int count) {
 
 uint32_t lines_written = 0;
 
-// Add up a bunch of measurements together to minize noise
-void oversample(int times) {
-	measure(times);
+// Move a rotated log on to the next file once the current one is full. 
+// Checked after each write, so files can go over by a write. The new file 
+// starts with the banner and self test results, so it can be read on its own.
+void log_check_full(uint8_t readings) {
+	log_readings += readings;
+	if (!log_rotating() || !log_full()) return;
+	queued_records = open_records = 0; // The open block stays in the old file
+	log_next();
+	write_banner(0);
+	write_self_test(0);
+}
 
-	int32_t acc = 0;
-	for (int i = 0; i < times; i++) acc += burst_buffer[i];
-	
-	int32_t avg = (acc / times / 5);
-	if (avg < 0) avg *= -1;
-	if (avg > 1800) saturated();
+// Writes since the last energy record
+int32_t energy_writes = 0;
+
+// Every energy_log writes, log where the time went since the last energy
+// record, with the readings taken in that time. Everything is counted up
+// to the point the record is written, the rest of the write goes into the
+// next one. Binary records also have the time, for finding the end of the
+// log (block_last_time()). In the CSV log:
+//   Energy,elapsed,standby,idle,sensor,card,card busy,readings
+// Returns 1 if a record was written.
+uint8_t write_energy() {
+	if (!energy_log || ++energy_writes < energy_log) return 0;
+	energy_writes = 0;
+
+	energy_t taken = energy_take();
+	uint64_t* ticks = &taken.elapsed;
+	if (log_format) {
+		uint32_t time = time_now(0);
+		block_start(BLOCK_ENERGY);
+		block_put(&time, 4);
+		for (uint8_t i = 0; i < 6; i++) block_put(&ticks[i], 8);
+		block_put(&taken.readings, 4);
+		block_write(1);
+	} else {
+		text_start();
+		text_string("Energy");
+		for (uint8_t i = 0; i < 6; i++) {
+			text_char(',');
+			text_uint64(ticks[i]);
+		}
+		text_char(',');
+		text_uint(taken.readings, 1);
+		text_char('\n');
+		text_flush();
+	}
+	return 1;
+}
+
+// Write out all queued readings. In a binary log, the last block is kept
+// open if it isn't full (open_records).
+void flush_records() {
+	if (queued_records == open_records) return;
+
+	uint8_t open = 0;
+	sd_wake();
+	trace(TRACE_WRITE);
+	if (log_format) {
+		if (open_records) log_rewind();
+		for (uint8_t first = 0; first < queued_records; ) {
+			uint8_t count = queued_records - first;
+			if (count > BLOCK_PAYLOAD / 20) count = BLOCK_PAYLOAD / 20;
+			open = count < BLOCK_PAYLOAD / 20 ? count : 0;
+			block_start(BLOCK_READINGS_TIMED);
+			for (uint8_t i = first; i < first + count; i++) {
+				block_put(&buffers.queue[i].counter, 4);
+				block_put(&buffers.queue[i].time, 4);
+				block_put(&buffers.queue[i].ms, 2);
+				block_put(&buffers.queue[i].saturated, 2);
+				block_put(&buffers.queue[i].value, 8);
+			}
+			block_write(count);
+			first += count;
+		}
+	} else {
+		text_start();
+		for (uint8_t i = 0; i < queued_records; i++) {
+			text_uint(buffers.queue[i].counter, 1);
+			text_char(',');
+			text_int(buffers.queue[i].value);
+			text_char(',');
+			text_time(buffers.queue[i].time, buffers.queue[i].ms);
+			text_char('\n');
+			if (buffers.queue[i].saturated) {
+				text_string("Sat,");
+				text_uint(buffers.queue[i].saturated, 1);
+				text_char('\n');
+			}
+		}
+		text_flush();
+	}
+	if (write_energy()) open = 0; // The open block isn't the last one now
+	trace(TRACE_WRITE | TRACE_END);
+	trace(TRACE_SYNC);
+	f_sync(&fd);
+	trace(TRACE_SYNC | TRACE_END);
+
+	uint8_t written = queued_records - open_records;
+	for (uint8_t i = 0; i < open; i++) buffers.queue[i] = buffers.queue[queued_records - open + i];
+	queued_records = open_records = open;
+	log_check_full(written);
+	trace_dump();
+	sd_sleep();
+}
+
+// Add up a bunch of measurements together to minize noise
+void oversample(int32_t times) {
+	measure(0, times);
+	if (acq_saturated) saturated();
 	
-	sd_init();
-	f_printf(&fd, "%ld,%ld\n", lines_written, acc); 
+	buffers.queue[queued_records].counter = lines_written;
+	buffers.queue[queued_records].time = time_now(&buffers.queue[queued_records].ms);
+	buffers.queue[queued_records].saturated = acq_saturated;
+	buffers.queue[queued_records].value = acq_sum;
+	queued_records++;
+	energy.readings++;
+	lines_written++;	
+
+	if (queued_records - open_records >= batch_size || queued_records == MAX_QUEUE) flush_records();
+}
+
+// Compressed bursts. Consecutive samples are close together, so only the
+// difference from the previous one is stored, zigzag encoded to make it 
+// positive (0, -1, 1, -2, ... become 0, 1, 2, 3, ...), and Rice coded: the 
+// value shifted down by k in unary (that many 1 bits, then a 0), followed by
+// its low k bits. Bits are filled in from the top of each byte. Unary parts
+// of RICE_ESCAPE or more are written as RICE_ESCAPE 1 bits followed by the 
+// whole 32 bit value, so a spike doesn't take up a whole block.
+//
+// k is picked for each block from the average of the values that will go
+// into it, which is about the best a single parameter can do.
+#define RICE_ESCAPE 24
+#define RICE_START 27 // Offset of the coded differences in the block
+#define RICE_BITS ((510 - RICE_START) * 8)
+
+uint16_t rice_bits; // Bits written after RICE_START
+
+void rice_put(uint32_t value, uint8_t bits) {
+	while (bits--) {
+		if (value >> bits & 1) log_block[RICE_START + rice_bits / 8] |= 0x80 >> rice_bits % 8;
+		rice_bits++;
+	}
+}
+
+uint32_t zigzag(int32_t delta) {
+	return (uint32_t)delta << 1 ^ (uint32_t)(delta >> 31);
+}
+
+// Bits taken up by a value
+uint8_t rice_length(uint32_t value, uint8_t k) {
+	uint32_t unary = value >> k;
+	return unary >= RICE_ESCAPE ? RICE_ESCAPE + 32 : unary + 1 + k;
+}
+
+void write_burst_rice(int32_t* samples, uint16_t total, uint32_t time, uint16_t ms, uint16_t saturations) {
+	for (uint16_t first = 0; first < total; ) {
+		// Average over the samples that could fit, at a bit each
+		uint16_t window = total - first - 1;
+		if (window > RICE_BITS) window = RICE_BITS;
+		uint64_t sum = 0;
+		for (uint16_t i = first + 1; i <= first + window; i++) sum += zigzag(samples[i] - samples[i - 1]);
+		uint8_t k = 0;
+		while (k < 31 && ((uint64_t)window << k) < sum) k++;
+
+		block_start(BLOCK_BURST_RICE);
+		block_put(&lines_written, 4);
+		block_put(&time, 4);
+		block_put(&ms, 2);
+		block_put(&first, 2);
+		block_put(&total, 2);
+		block_put(&saturations, 2);
+		log_block_len += 2; // Count, filled in at the end
+		block_put(&k, 1);
+		block_put(&samples[first], 4);
+
+		rice_bits = 0;
+		uint16_t count = 1;
+		while (first + count < total) {
+			uint32_t value = zigzag(samples[first + count] - samples[first + count - 1]);
+			uint8_t length = rice_length(value, k);
+			if (rice_bits + length > RICE_BITS) break;
+			uint32_t unary = value >> k;
+			if (unary >= RICE_ESCAPE) {
+				rice_put(0xFFFFFFFF, RICE_ESCAPE);
+				rice_put(value, 32);
+			} else {
+				for (uint32_t i = 0; i < unary; i++) rice_put(1, 1);
+				rice_put(0, 1);
+				rice_put(value, k);
+			}
+			count++;
+		}
+		log_block[20] = (uint8_t)count;
+		log_block[21] = count >> 8;
+		block_write(0);
+		first += count;
+	}
+}
+
+// Write out a burst of raw samples, along with the number of saturated
+// half-cycles in it, and the RTC ticks when it was finished.
+void write_burst(int32_t* samples, int times, uint16_t saturations, uint64_t ticks) {
+	uint16_t ms;
+	uint32_t time = time_at(ticks, &ms);
+
+	sd_wake();
+	trace(TRACE_WRITE);
+	if (log_format == 2) {
+		write_burst_rice(samples, times, time, ms, saturations);
+	} else if (log_format) {
+		uint16_t total = times;
+		for (uint16_t first = 0; first < total; ) {
+			uint16_t count = total - first;
+			if (count > (BLOCK_PAYLOAD - 16) / 4) count = (BLOCK_PAYLOAD - 16) / 4;
+			block_start(BLOCK_BURST_TIMED);
+			block_put(&lines_written, 4);
+			block_put(&time, 4);
+			block_put(&ms, 2);
+			block_put(&first, 2);
+			block_put(&total, 2);
+			block_put(&saturations, 2);
+			block_put(&samples[first], count * 4);
+			block_write(count);
+			first += count;
+		}
+	} else {
+		text_start();
+		text_string("Time,");
+		text_time(time, ms);
+		text_char('\n');
+		text_uint(lines_written, 1);
+		text_char(',');
+		for (int i = 0; i < times; i++) {
+			text_int(samples[i]);
+			text_char(',');
+		}
+		text_char('\n');
+		if (saturations) {
+			text_string("Sat,");
+			text_uint(saturations, 1);
+			text_char('\n');
+		}
+		text_flush();
+	}
+	energy.readings++;
+	write_energy();
+	trace(TRACE_WRITE | TRACE_END);
+
+	trace(TRACE_SYNC);
 	f_sync(&fd);
+	trace(TRACE_SYNC | TRACE_END);
+	log_check_full(1);
 	lines_written++;	
-	sd_power_off();
+	trace_dump();
+	sd_sleep();
 }
 
 // Dump all the raw measurements to allow recording AC fields
 void burst(int times) {
-	measure(times);
+	measure(buffers.burst, times);
+	
+	write_burst(buffers.burst, times, acq_saturated, rtc_now());
+
+	// Flash LED if sensor saturated during burst 
+	if (acq_saturated) saturated();
+}
 
-	int is_saturated = 0;
+// Record bursts back to back without any gaps. Half of buffers.burst is
+// filled by the interrupts while the other half is written to the card.
+// Bursts dropped because the card fell behind still count up the counter.
+// This never returns.
+void continuous(int times) {
+	if (times > MAX_BURST / 2) times = MAX_BURST / 2;
 
-	sd_init();
-	f_printf(&fd, "%ld,", lines_written); 
-	for (int i = 0; i < times; i++) {
-		f_printf(&fd, "%d,", burst_buffer[i]); 
-		if (burst_buffer[i] > 1800 * 5) is_saturated = 1;
-		if (burst_buffer[i] < -1800 * 5) is_saturated = 1;
-	}
-	f_printf(&fd, "\n"); 
+	acquisition_start(buffers.burst, times, 1);
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_enable();
 	
-	// Flash LED if sensor saturated during burst 
-	if (is_saturated) saturated();
+	while (1) {
+		while (!acq_pending) sleep_cpu();
 
-	f_sync(&fd);
-	lines_written++;	
-	sd_power_off();
+		cli();
+		lines_written += acq_overruns;
+		acq_overruns = 0;
+		sei();
+
+		// Don't flash the LED on saturation, that would hold up the next write
+		write_burst(acq_pending, times, acq_pending_saturated, acq_pending_ticks);
+		acq_pending = 0;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// Scheduling. Between readings the CPU is in standby, with the main clock  //
+// stopped, and the RTC wakes it up for the next one.                       //
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+
+// Sleep untill the RTC reaches time. The overflows wake the CPU every 2 s, 
+// once the time is less than that away the compare match is set to wake it
+// up on time.
+void rtc_sleep_until(uint64_t time) {
+	set_sleep_mode(SLEEP_MODE_STANDBY);
+	sleep_enable();
+	while (1) {
+		uint64_t now = rtc_now();
+		if (now >= time) break;
+		if (time - now <= 0xFFFF) {
+			while (RTC.STATUS & 0x8) ; // CMPBUSY
+			RTC.CMP = time;
+			RTC.INTCTRL = 0x3; // Overflow and compare match interrupts
+			// The compare match takes a few ticks to take effect, and the
+			// time may have passed waiting for CMPBUSY. Not time - now, 
+			// which would wrap around then.
+			if (rtc_now() + 4 > time) continue;
+		}
+		sleep_cpu();
+		energy.standby += rtc_now() - now;
+	}
+	sleep_disable();
+	RTC.INTCTRL = 0x1;
+}
+
+// Readings are scheduled at fixed times from the first one. The interval
+// usually isn't a whole number of RTC ticks, so the leftover thousandths of
+// a tick are carried over from one reading to the next instead of being 
+// rounded off each time, which would add up into drift.
+uint64_t next_reading;
+uint16_t next_reading_fraction;
+
+// Move the schedule on by some number of intervals
+void schedule_readings(uint32_t intervals) {
+	uint64_t step = (uint64_t)log_interval * RTC_HZ * intervals + next_reading_fraction;
+	next_reading += step / 1000;
+	next_reading_fraction = step % 1000;
+}
+
+// Sleep untill the next reading is due. Readings that are already late are
+// skipped, to get back on schedule.
+void wait_for_reading() {
+	uint64_t now = rtc_now();
+	if (next_reading < now) {
+		schedule_readings((now - next_reading) * 1000 / RTC_HZ / log_interval + 1);
+	}
+	rtc_sleep_until(next_reading);
+	schedule_readings(1);
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -510,43 +2144,57 @@ void burst(int times) {
 
 
 
-void write_banner() {
-	f_puts("\n,,Fluxgate datalogger: restarted.\n", &fd);
-	f_printf(&fd, "Tlog,%ld\n", log_interval);
-	f_printf(&fd, "OSR,%d\n", oversampling_ratio);
+// The banner at the start of a new file of a rotated log says so instead of
+// restarted, the readings carry on from the last file.
+void write_banner(uint8_t restarted) {
+	if (log_format) return; // Binary logs write a header after the self test
+	f_puts(restarted ? "\n,,Fluxgate datalogger: restarted.\n" : ",,Fluxgate datalogger: new log file.\n", &fd);
+	f_printf(&fd, "Tlog,%ld\n", (long)log_interval);
+	f_printf(&fd, "OSR,%ld\n", (long)oversampling_ratio);
+	f_printf(&fd, "Time,%lu.000\n", (unsigned long)time_now(0));
+	if (adc_accumulation) f_printf(&fd, "Accumulation,%d\n", 1 << adc_accumulation);
+	if (integration != 10) f_printf(&fd, "Integration,%ld\n", (long)integration);
 	f_sync(&fd);
 }
 
 int main(void) {
 	PORTC.DIRSET = 0xFF; // LED + Drive coil + PM mosfets
+	sei(); // Measurements are interrupt driven
 
 	PORTA.DIRSET = 1 << 4 | 1 << 5 | 1 << 6 | 1 << 7; // Sd card spi pins
 	SPI0.CTRLA = 1 << 5 | 0x3 << 1 | 1; // SPI: Master, max prescaler, enabled
 
 	adc_setup();
+	rtc_setup();
+	trace_setup();
 	
 	// Mount the card, read config and open log file
 	sd_init();
 	if (f_mount(&fs, "", 1)) sd_timeout();
 	read_config();
-	if (f_open(&fd, "/FLUXGATE.CSV", FA_WRITE | FA_OPEN_APPEND)) sd_timeout();
-	write_banner();
+	log_start();
+
+	// Pick up the time from where the log left off, or the config
+	if (log_time) time_set(log_time + 1);
+	time_set(config_time);
+	trace_open(time_now(0));
+	write_banner(1);
 
 	// Run self test, this writes to the card
 	self_test();
 	
 	// Turn off the card to conserve power.
-	sd_power_off();
+	sd_sleep();
+
+	// Continuous mode has no log interval
+	if (burst_mode == 2) continuous(oversampling_ratio);
 
-	// Max = ~33 seconds
-	TCA0.SINGLE.PER = log_interval * 1959 / 1000;
-	TCA0.SINGLE.CTRLA = 0b10001111; // clk_per/1024 = 1.953 kHz
+	next_reading = rtc_now();
+	schedule_readings(1);
 	
 	// Loggging loop
 	while (1) {
-		// Wait for timer to overflow
-		while (~TCA0.SINGLE.INTFLAGS & 1) ;
-		TCA0.SINGLE.INTFLAGS = 1;
+		wait_for_reading();
 
 		// Record field reading
 		_delay_ms(10);
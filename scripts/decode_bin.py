@@ -0,0 +1,136 @@
+# Convert a binary log (FLUXGATE.BIN) into the same CSV layout as FLUXGATE.CSV
+# Usage: python3 decode_bin.py [FLUXGATE.BIN] > fluxgate.csv
+# The files of a rotated log can be given in order: decode_bin.py FG*.BIN
+import struct
+import sys
+
+BLOCK_MAGIC = 0x4746
+BLOCK_HEADER = 1
+BLOCK_READINGS = 2
+BLOCK_BURST = 3
+BLOCK_READINGS64 = 4
+BLOCK_BURST32 = 5
+BLOCK_READINGS_TIMED = 6
+BLOCK_BURST_TIMED = 7
+BLOCK_BURST_RICE = 8
+BLOCK_ENERGY = 9
+
+RICE_ESCAPE = 24
+RICE_START = 27
+
+def crc16(data):
+	crc = 0xffff
+	for byte in data:
+		crc ^= byte << 8
+		for bit in range(8):
+			if crc & 0x8000:
+				crc = (crc << 1 ^ 0x1021) & 0xffff
+			else:
+				crc = (crc << 1) & 0xffff
+	return crc
+
+# Undo write_burst_rice(): count - 1 Rice coded, zigzag encoded differences
+# following the first sample
+def decode_rice(block, count, k, first):
+	bits = int.from_bytes(block[RICE_START:510], 'big')
+	position = (510 - RICE_START) * 8
+	def take(n):
+		nonlocal position
+		position -= n
+		return bits >> position & ((1 << n) - 1)
+
+	samples = [first]
+	for i in range(count - 1):
+		unary = 0
+		while unary < RICE_ESCAPE and take(1):
+			unary += 1
+		value = take(32) if unary == RICE_ESCAPE else unary << k | take(k)
+		delta = value >> 1 ^ -(value & 1)
+		samples.append((samples[-1] + delta + 2**31) % 2**32 - 2**31)
+	return samples
+
+def decode(file, out):
+	burst = None # (counter, samples) of the burst being reassembled
+	while True:
+		block = file.read(512)
+		if len(block) < 512:
+			break
+		magic, kind, count = struct.unpack_from('<HBB', block, 0)
+		if magic != BLOCK_MAGIC or crc16(block[:510]) != struct.unpack_from('<H', block, 510)[0]:
+			print("Skipping corrupt block", file=sys.stderr)
+			continue
+
+		if kind == BLOCK_HEADER:
+			tlog, osr, burst_mode, vdiv, vamp, vdiff, failed, accumulation, integration, time, new_file = struct.unpack_from('<lllhhhBBhLB', block, 4)
+			if new_file:
+				out.write(",,Fluxgate datalogger: new log file.\n")
+			else:
+				out.write("\n,,Fluxgate datalogger: restarted.\n")
+			out.write(f"Tlog,{tlog}\n")
+			out.write(f"OSR,{osr}\n")
+			if time:
+				out.write(f"Time,{time}.000\n")
+			if accumulation:
+				out.write(f"Accumulation,{1 << accumulation}\n")
+			if integration and integration != 10:
+				out.write(f"Integration,{integration}\n")
+			out.write(f"Vdiv,{vdiv}\n")
+			out.write(f"Vamp,{vamp}\n")
+			out.write(f"Vdiff,{vdiff}\n")
+			if failed:
+				out.write(",,Self test failed. Giving up.\n")
+
+		elif kind == BLOCK_READINGS:
+			for counter, reading in struct.iter_unpack('<Ll', block[4:4 + 8 * count]):
+				out.write(f"{counter},{reading}\n")
+
+		elif kind == BLOCK_READINGS64:
+			for counter, reading, saturated in struct.iter_unpack('<LqH', block[4:4 + 14 * count]):
+				out.write(f"{counter},{reading}\n")
+				if saturated:
+					out.write(f"Sat,{saturated}\n")
+
+		elif kind == BLOCK_READINGS_TIMED:
+			for counter, time, ms, saturated, reading in struct.iter_unpack('<LLHHq', block[4:4 + 20 * count]):
+				out.write(f"{counter},{reading},{time}.{ms:03}\n")
+				if saturated:
+					out.write(f"Sat,{saturated}\n")
+
+		elif kind == BLOCK_ENERGY:
+			# The time is left out, CSV energy records don't have it
+			out.write("Energy," + ",".join(str(value) for value in struct.unpack_from('<6QL', block, 8)) + "\n")
+
+		elif kind in (BLOCK_BURST, BLOCK_BURST32, BLOCK_BURST_TIMED, BLOCK_BURST_RICE):
+			time = None
+			if kind == BLOCK_BURST:
+				counter, first, total = struct.unpack_from('<LHH', block, 4)
+				saturated = 0
+				samples = struct.unpack_from(f'<{count}h', block, 12)
+			elif kind == BLOCK_BURST32:
+				counter, first, total, saturated = struct.unpack_from('<LHHH', block, 4)
+				samples = struct.unpack_from(f'<{count}l', block, 14)
+			elif kind == BLOCK_BURST_TIMED:
+				counter, time, ms, first, total, saturated = struct.unpack_from('<LLHHHH', block, 4)
+				samples = struct.unpack_from(f'<{count}l', block, 20)
+			else:
+				counter, time, ms, first, total, saturated, count, k, sample = struct.unpack_from('<LLHHHHHBl', block, 4)
+				samples = decode_rice(block, count, k, sample)
+			if first == 0:
+				burst = (counter, [])
+				if time is not None:
+					out.write(f"Time,{time}.{ms:03}\n")
+			if burst is None or burst[0] != counter or len(burst[1]) != first:
+				print(f"Incomplete burst {counter}", file=sys.stderr)
+				burst = None
+				continue
+			burst[1].extend(samples)
+			if len(burst[1]) == total:
+				out.write(f"{counter}," + "".join(f"{sample}," for sample in burst[1]) + "\n")
+				if saturated:
+					out.write(f"Sat,{saturated}\n")
+				burst = None
+
+if __name__ == "__main__":
+	for name in sys.argv[1:] or ["FLUXGATE.BIN"]:
+		with open(name, "rb") as file:
+			decode(file, sys.stdout)
@@ -0,0 +1,64 @@
+# Summarize a timing trace (TRACE.BIN) written by firmware built with TRACE=1
+# Usage: python3 decode_trace.py [TRACE.BIN] [--list]
+# --list prints every traced operation, instead of just the totals
+import struct
+import sys
+
+TICKS_PER_MS = 24000000 / 2 / 1000 # TCB1 runs at F_CPU/2
+
+TRACE_RESTART = 1
+TRACE_LOST = 8
+TRACE_END = 0x80
+
+NAMES = {
+	2: "measure",
+	3: "sd_init",
+	4: "write",
+	5: "f_sync",
+	6: "card busy",
+	7: "sd_power_off",
+}
+
+def entries(file):
+	while True:
+		count = file.read(1)
+		if not count:
+			break
+		count = count[0]
+		events = file.read(count)
+		ticks = file.read(4 * count)
+		if len(ticks) < 4 * count:
+			print("Trace cut short", file=sys.stderr)
+			break
+		yield from zip(events, struct.unpack(f'<{count}L', ticks))
+
+def decode(file, listing):
+	started = {} # event: ticks at the start
+	durations = {} # event: [ms, ...]
+	for event, ticks in entries(file):
+		if event == TRACE_RESTART:
+			if listing:
+				print(f"Restarted, time {ticks}")
+			started = {}
+		elif event == TRACE_LOST:
+			print(f"{ticks} trace entries lost", file=sys.stderr)
+			started = {}
+		elif event & TRACE_END:
+			event &= ~TRACE_END
+			if event not in started:
+				continue
+			ms = ((ticks - started.pop(event)) % 2**32) / TICKS_PER_MS
+			durations.setdefault(event, []).append(ms)
+			if listing:
+				print(f"{NAMES.get(event, event)},{ms:.3f}")
+		else:
+			started[event] = ticks
+
+	print(f"{'operation':<14}{'count':>8}{'total ms':>12}{'mean ms':>10}{'max ms':>10}")
+	for event, ms in sorted(durations.items()):
+		print(f"{NAMES.get(event, event):<14}{len(ms):>8}{sum(ms):>12.1f}{sum(ms) / len(ms):>10.3f}{max(ms):>10.3f}")
+
+if __name__ == "__main__":
+	args = [arg for arg in sys.argv[1:] if arg != "--list"]
+	with open(args[0] if args else "TRACE.BIN", "rb") as file:
+		decode(file, "--list" in sys.argv)
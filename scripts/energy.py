@@ -0,0 +1,78 @@
+# Work out battery use from the Energy records in a log (see write_energy()
+# in main.c, and ENERGY in write_cfg.py), given the current drawn by each
+# part of the logger. The defaults are rough figures, measure your own.
+#
+# Usage: python3 energy.py [--sensor mA ...] [--battery mAh] [FLUXGATE.CSV or FLUXGATE.BIN ...]
+import argparse
+import io
+import sys
+
+from decode_bin import decode
+
+RTC_HZ = 32768
+
+# Current in mA. The CPU draws active current whenever it isn't in standby
+# or idle. The card draws card_busy on top of card while it's programing.
+CURRENTS = dict(
+	standby=0.002, # CPU in standby, RTC running
+	idle=1.5, # CPU idle while measuring
+	active=5.0, # CPU running at 24 MHz
+	sensor=15.0, # Amplifier and drive coil
+	card=1.0, # Card powered, mostly idle
+	card_busy=30.0, # Extra while programing
+)
+
+def records(lines):
+	for line in lines:
+		fields = line.rstrip().split(',')
+		if fields[0] == "Energy" and len(fields) == 8:
+			yield [int(field) for field in fields[1:]]
+
+def read(name):
+	if name.upper().endswith('.BIN'):
+		with open(name, 'rb') as file:
+			text = io.StringIO()
+			decode(file, text)
+			return text.getvalue().splitlines()
+	with open(name) as file:
+		return file.readlines()
+
+def main():
+	parser = argparse.ArgumentParser(description="Battery use from the Energy records in a log")
+	parser.add_argument('logs', nargs='*', default=["FLUXGATE.CSV"])
+	for rail, current in CURRENTS.items():
+		parser.add_argument('--' + rail.replace('_', '-'), type=float, default=current, metavar='mA')
+	parser.add_argument('--battery', type=float, help="Battery capacity in mAh, to estimate how long it lasts")
+	args = parser.parse_args()
+
+	totals = [0] * 7
+	for name in args.logs:
+		for record in records(read(name)):
+			totals = [total + value for total, value in zip(totals, record)]
+	elapsed, standby, idle, sensor, card, card_busy, readings = totals
+	if not elapsed:
+		sys.exit("No energy records found, set ENERGY in the config")
+
+	active = elapsed - standby - idle
+	# Charge in mA * ticks
+	parts = dict(
+		cpu=standby * args.standby + idle * args.idle + active * args.active,
+		sensor=sensor * args.sensor,
+		card=card * args.card + card_busy * args.card_busy,
+	)
+	charge = sum(parts.values())
+	seconds = elapsed / RTC_HZ
+	average = charge / elapsed
+	print(f"Covered {seconds:.1f} s, {readings} readings")
+	print(f"Time: {100 * standby / elapsed:.1f}% standby, {100 * idle / elapsed:.1f}% idle, {100 * active / elapsed:.1f}% active, "
+		f"sensor on {100 * sensor / elapsed:.1f}%, card on {100 * card / elapsed:.1f}%, card busy {100 * card_busy / elapsed:.2f}%")
+	print(f"Average current: {average:.3f} mA")
+	print(f"Per day: {average * 24:.2f} mAh")
+	if readings:
+		print(f"Per reading: {charge / RTC_HZ / 3.6 / readings:.3f} uAh")
+	print("Share: " + ", ".join(f"{name} {100 * part / charge:.1f}%" for name, part in parts.items()))
+	if args.battery:
+		print(f"Battery life: {args.battery / average / 24:.1f} days")
+
+if __name__ == '__main__':
+	main()
@@ -0,0 +1,439 @@
+# Load fluxgate logs (FLUXGATE.CSV, FLUXGATE.BIN or rotated FG*.CSV/BIN)
+# into numpy arrays, a chunk at a time.
+#
+#   import fluxgate_log
+#   for segment in fluxgate_log.load("FLUXGATE.CSV"):
+#       print(segment.header["OSR"], segment.readings["reading"].mean())
+#
+# A segment is everything between two startup banners (or header blocks), so
+# each restart or new log file starts a new one. Each segment has:
+#   header    dict of the startup lines: Tlog, OSR, Time, Accumulation,
+#             Integration, Vdiv, Vamp, Vdiff
+#   new_file  True if it was a new log file rather than a restart
+#   failed    True if the self test failed
+#   readings  array of READING: counter, reading, time (Unix time, nan if the
+#             log has none) and saturated half-cycles
+#   bursts    array of BURST: counter, time, saturated, and where its samples
+#             are in samples, see Segment.burst()
+#   samples   int32 samples of all bursts, one after another
+#   energy    array of ENERGY records, if they were turned on. Their time
+#             is only in binary logs, nan in CSV ones.
+#
+# read() yields the same, a piece of a segment at a time (pieces of the same
+# segment have the same index), and only keeps about chunk_size bytes of the
+# log in memory. load() joins the pieces up.
+#
+# Usage: python3 fluxgate_log.py [FLUXGATE.CSV ...] prints a summary
+import re
+import struct
+import sys
+
+import numpy as np
+
+from decode_bin import (BLOCK_MAGIC, BLOCK_HEADER, BLOCK_READINGS, BLOCK_BURST,
+	BLOCK_READINGS64, BLOCK_BURST32, BLOCK_READINGS_TIMED, BLOCK_BURST_TIMED,
+	BLOCK_BURST_RICE, BLOCK_ENERGY, decode_rice)
+
+CHUNK_SIZE = 1 << 22
+
+READING = np.dtype([('counter', 'u4'), ('reading', 'i8'), ('time', 'f8'), ('saturated', 'u2')])
+BURST = np.dtype([('counter', 'u4'), ('time', 'f8'), ('saturated', 'u2'), ('start', 'i8'), ('length', 'i4')])
+ENERGY_TICKS = ('elapsed', 'standby', 'idle', 'sensor', 'card', 'busy')
+ENERGY = np.dtype([('time', 'f8')] + [(name, 'u8') for name in ENERGY_TICKS] + [('readings', 'u4')])
+
+class Segment:
+	def __init__(self, info, readings, bursts, samples, energy):
+		self.index = info.index
+		self.header = info.header
+		self.new_file = info.new_file
+		self.failed = info.failed
+		self.readings = readings
+		self.bursts = bursts
+		self.samples = samples
+		self.energy = energy
+
+	def burst(self, i):
+		return self.samples[self.bursts['start'][i]:][:self.bursts['length'][i]]
+
+# What is known about a segment from its banner and header
+class Info:
+	def __init__(self, index, new_file=False):
+		self.index = index
+		self.new_file = new_file
+		self.failed = False
+		self.started = False # Has a banner, not just data before the first one
+		self.has_data = False
+		self.header = {'Accumulation': 1, 'Integration': 10}
+
+class State:
+	def __init__(self):
+		self.info = None
+		self.burst = None # Binary burst being reassembled
+
+	def banner(self, new_file):
+		if self.info is None or self.info.started or self.info.has_data:
+			self.info = Info(self.info.index + 1 if self.info else 0)
+		self.info.started = True
+		self.info.new_file = new_file
+		return self.info
+
+	def current(self):
+		if self.info is None:
+			self.info = Info(0)
+		return self.info
+
+# Split the rows of a chunk up between the segments that start at the given
+# positions (lines or blocks), infos[0] being the one carried over
+def pieces(infos, starts, readings, reading_at, bursts, burst_at, samples, energy, energy_at):
+	reading_segment = np.searchsorted(starts, reading_at, 'right')
+	burst_segment = np.searchsorted(starts, burst_at, 'right')
+	energy_segment = np.searchsorted(starts, energy_at, 'right')
+	for k, info in enumerate(infos):
+		piece_bursts = bursts[burst_segment == k]
+		if len(piece_bursts):
+			first = piece_bursts['start'][0]
+			piece_samples = samples[first:piece_bursts['start'][-1] + piece_bursts['length'][-1]]
+			piece_bursts['start'] -= first
+		else:
+			piece_samples = samples[:0]
+		segment = Segment(info, readings[reading_segment == k], piece_bursts, piece_samples, energy[energy_segment == k])
+		if len(segment.readings) or len(segment.bursts) or len(segment.energy):
+			info.has_data = True
+		if info.started or info.has_data:
+			yield segment
+
+###############################################################################
+# CSV logs
+
+DIGIT = np.zeros(256, bool)
+DIGIT[ord('0'):ord('9') + 1] = True
+NUMERIC = DIGIT.copy()
+NUMERIC[[ord(','), ord('-'), ord('.'), ord('\n')]] = True
+SEPARATORS = bytes.maketrans(b',.\n', b'   ')
+
+# Where the buffer can be split: before a line of numbers, as long as it
+# doesn't follow the Time line of a burst. That keeps Sat and Time lines
+# with their readings, and headers with their banner.
+def csv_cut(buf):
+	end = buf.rfind(b'\n')
+	while end >= 0:
+		start = buf.rfind(b'\n', 0, end) + 1
+		if end + 1 < len(buf) and buf[end + 1:end + 2].isdigit() and not buf.startswith(b'Time,', start):
+			return end + 1
+		end = start - 1
+	return None
+
+def csv_chunks(file, chunk_size):
+	carry = b''
+	while True:
+		data = file.read(chunk_size)
+		buf = carry + data
+		if not data:
+			if buf.strip():
+				yield buf if buf.endswith(b'\n') else buf + b'\n'
+			return
+		cut = csv_cut(buf)
+		if cut is None:
+			carry = buf
+		else:
+			yield buf[:cut]
+			carry = buf[cut:]
+
+NUMBERS = re.compile(rb'[0-9]+,-?[0-9]+(,[0-9]+\.[0-9]+)?|[0-9]+,(-?[0-9]+,)+')
+
+# The count integers in text, or None if there aren't that many
+def numbers(text, count):
+	if not count:
+		return np.zeros(0, np.int64)
+	values = np.fromstring(bytes(text), dtype=np.int64, sep=' ')
+	return values if len(values) == count else None
+
+# Count of the positions before each end
+def per_line(positions, ends):
+	return np.diff(np.searchsorted(positions, ends), prepend=0)
+
+def parse_csv(buf, state):
+	buf = buf.replace(b'\r', b'')
+	a = np.frombuffer(buf, np.uint8)
+	ends = np.flatnonzero(a == ord('\n'))
+	starts = np.concatenate(([0], ends[:-1] + 1))
+	commas = per_line(np.flatnonzero(a == ord(',')), ends)
+	dots = per_line(np.flatnonzero(a == ord('.')), ends)
+	# Lines of nothing but numbers: readings (counter,reading[,s.ms]), or
+	# bursts (counter,sample,...,sample,)
+	burst = a[ends - 1] == ord(',')
+	data = DIGIT[a[starts]] & ~np.logical_or.reduceat(~NUMERIC[a], starts)
+	data &= np.where(burst, (commas >= 2) & (dots == 0), (commas == 1) & (dots == 0) | (commas == 2) & (dots == 1))
+
+	# Parse all their numbers in one go. Times are split into seconds and
+	# milliseconds, so they are integers too.
+	text = bytearray(buf.translate(SEPARATORS))
+	for i in np.flatnonzero(~data):
+		text[starts[i]:ends[i]] = b' ' * (ends[i] - starts[i])
+	tokens = (np.where(burst, commas, commas + 1) + dots)[data]
+	values = numbers(text, tokens.sum())
+	if values is None:
+		# Some line only looks like numbers, find it the slow way
+		for i in np.flatnonzero(data):
+			if not NUMBERS.fullmatch(buf[starts[i]:ends[i]]):
+				data[i] = False
+				text[starts[i]:ends[i]] = b' ' * (ends[i] - starts[i])
+		tokens = (np.where(burst, commas, commas + 1) + dots)[data]
+		values = numbers(text, tokens.sum())
+	offsets = np.cumsum(tokens) - tokens
+	data_lines = np.flatnonzero(data)
+	is_burst = burst[data_lines]
+
+	# Everything else a line at a time: banners, headers, and the few Time,
+	# Sat and Energy lines
+	infos = [state.current()]
+	banners = []
+	data_before = np.cumsum(data)
+	base = -1 if state.info.has_data else 0
+	sat_lines, sats, time_lines, times, energy_lines, energy = [], [], [], [], [], []
+	for i in np.flatnonzero(~data):
+		label, _, value = buf[starts[i]:ends[i]].decode('ascii', 'replace').partition(',')
+		try:
+			if not label:
+				if "Fluxgate datalogger" in value:
+					state.info.has_data |= bool(data_before[i] > base)
+					info = state.banner("new log file" in value)
+					if info is not infos[-1]:
+						infos.append(info)
+						banners.append(i)
+					base = data_before[i]
+				elif "Self test failed" in value:
+					state.info.failed = True
+			elif label == "Sat":
+				if i > 0 and data[i - 1]:
+					sat_lines.append(i - 1)
+					sats.append(int(value))
+			elif label == "Time":
+				if i + 1 < len(ends) and data[i + 1] and burst[i + 1]:
+					time_lines.append(i + 1)
+					times.append(float(value))
+				elif data_before[i] <= base:
+					state.info.header["Time"] = float(value)
+			elif label == "Energy":
+				energy_lines.append(i)
+				energy.append((np.nan,) + tuple(int(field) for field in value.split(',')))
+			else:
+				state.info.header[label] = int(value)
+		except ValueError:
+			print(f"Skipping line: {label},{value}", file=sys.stderr)
+
+	reading_lines = data_lines[~is_burst]
+	reading_offsets = offsets[~is_burst]
+	timed = tokens[~is_burst] == 4
+	readings = np.zeros(len(reading_lines), READING)
+	readings['counter'] = values[reading_offsets]
+	readings['reading'] = values[reading_offsets + 1]
+	readings['time'] = np.nan
+	readings['time'][timed] = values[reading_offsets[timed] + 2] + values[reading_offsets[timed] + 3] / 1000
+
+	burst_lines = data_lines[is_burst]
+	bursts = np.zeros(len(burst_lines), BURST)
+	bursts['counter'] = values[offsets[is_burst]]
+	bursts['length'] = tokens[is_burst] - 1
+	bursts['start'] = np.cumsum(bursts['length']) - bursts['length']
+	bursts['time'] = np.nan
+	sample = np.repeat(is_burst, tokens)
+	sample[offsets[is_burst]] = False
+	samples = values[sample].astype(np.int32)
+
+	for lines, rows in ((reading_lines, readings), (burst_lines, bursts)):
+		at = np.searchsorted(lines, sat_lines)
+		found = at < len(lines)
+		found[found] = lines[at[found]] == np.array(sat_lines, int)[found]
+		rows['saturated'][at[found]] = np.array(sats)[found]
+	at = np.searchsorted(burst_lines, time_lines)
+	bursts['time'][at] = times
+
+	yield from pieces(infos, banners, readings, reading_lines, bursts, burst_lines,
+		samples, np.array(energy, ENERGY), energy_lines)
+
+###############################################################################
+# Binary logs
+
+def crc_table():
+	table = np.zeros(256, np.uint16)
+	for i in range(256):
+		crc = i << 8
+		for bit in range(8):
+			crc = (crc << 1 ^ 0x1021) & 0xffff if crc & 0x8000 else (crc << 1) & 0xffff
+		table[i] = crc
+	return table
+
+CRC_TABLE = crc_table()
+
+# crc16() of each row
+def crc16(rows):
+	crc = np.full(len(rows), 0xffff, np.uint16)
+	for column in np.asfortranarray(rows).T:
+		crc = crc << 8 ^ CRC_TABLE[crc >> 8 ^ column]
+	return crc
+
+# Records packed into blocks, as in main.c
+READINGS_RECORD = np.dtype([('counter', '<u4'), ('reading', '<i4')])
+READINGS64_RECORD = np.dtype([('counter', '<u4'), ('reading', '<i8'), ('saturated', '<u2')])
+READINGS_TIMED_RECORD = np.dtype([('counter', '<u4'), ('time', '<u4'), ('ms', '<u2'), ('saturated', '<u2'), ('reading', '<i8')])
+ENERGY_RECORD = np.dtype([('time', '<u4')] + [(name, '<u8') for name in ENERGY_TICKS] + [('readings', '<u4')])
+RECORDS = {
+	BLOCK_READINGS: READINGS_RECORD,
+	BLOCK_READINGS64: READINGS64_RECORD,
+	BLOCK_READINGS_TIMED: READINGS_TIMED_RECORD,
+	BLOCK_ENERGY: ENERGY_RECORD,
+}
+
+# All records of one type in the blocks, and the block each came from
+def records(blocks, kinds, counts, kind):
+	dtype = RECORDS[kind]
+	selected = np.flatnonzero(kinds == kind)
+	per_block = (510 - 4) // dtype.itemsize
+	table = np.ascontiguousarray(blocks[selected, 4:4 + per_block * dtype.itemsize]).view(dtype)
+	used = np.arange(per_block) < counts[selected, None]
+	return table[used], np.repeat(selected, np.minimum(counts[selected], per_block))
+
+def bin_chunks(file, chunk_size):
+	while True:
+		buf = file.read(chunk_size // 512 * 512 or 512)
+		if len(buf) < 512:
+			return
+		yield buf
+
+def parse_bin(buf, state):
+	blocks = np.frombuffer(buf, np.uint8)[:len(buf) // 512 * 512].reshape(-1, 512)
+	magic = blocks[:, 0] | blocks[:, 1].astype(np.uint16) << 8
+	crc = blocks[:, 510] | blocks[:, 511].astype(np.uint16) << 8
+	valid = (magic == BLOCK_MAGIC) & (crc16(blocks[:, :510]) == crc)
+	if not valid.all():
+		print(f"Skipping {np.count_nonzero(~valid)} corrupt blocks", file=sys.stderr)
+	blocks = blocks[valid]
+	kinds = blocks[:, 2]
+	counts = blocks[:, 3]
+
+	readings = []
+	reading_at = []
+	for kind in (BLOCK_READINGS, BLOCK_READINGS64, BLOCK_READINGS_TIMED):
+		table, at = records(blocks, kinds, counts, kind)
+		rows = np.zeros(len(table), READING)
+		rows['counter'] = table['counter']
+		rows['reading'] = table['reading']
+		if kind == BLOCK_READINGS_TIMED:
+			rows['time'] = table['time'] + table['ms'] / 1000
+		else:
+			rows['time'] = np.nan
+		if kind != BLOCK_READINGS:
+			rows['saturated'] = table['saturated']
+		readings.append(rows)
+		reading_at.append(at)
+	reading_at = np.concatenate(reading_at)
+	order = np.argsort(reading_at, kind='stable')
+	readings = np.concatenate(readings)[order]
+	reading_at = reading_at[order]
+	stored, energy_at = records(blocks, kinds, counts, BLOCK_ENERGY)
+	energy = np.zeros(len(stored), ENERGY)
+	for name in ENERGY.names:
+		energy[name] = stored[name]
+
+	# Headers and bursts a block at a time, like decode_bin.py
+	infos = [state.current()]
+	banners = []
+	bursts, burst_at, samples = [], [], []
+	start = 0
+	for b in np.flatnonzero(np.isin(kinds, (BLOCK_HEADER, BLOCK_BURST, BLOCK_BURST32, BLOCK_BURST_TIMED, BLOCK_BURST_RICE))):
+		block = blocks[b].tobytes()
+		kind, count = kinds[b], counts[b]
+		if kind == BLOCK_HEADER:
+			tlog, osr, burst_mode, vdiv, vamp, vdiff, failed, accumulation, integration, time, new_file = struct.unpack_from('<lllhhhBBhLB', block, 4)
+			state.info.has_data |= bool(b > (banners[-1] + 1 if banners else 0))
+			info = state.banner(bool(new_file))
+			if info is not infos[-1]:
+				infos.append(info)
+				banners.append(b)
+			info.failed = bool(failed)
+			info.header.update(Tlog=tlog, OSR=osr, Time=float(time), Accumulation=1 << accumulation, Vdiv=vdiv, Vamp=vamp, Vdiff=vdiff)
+			if integration:
+				info.header['Integration'] = integration
+			state.burst = None
+			continue
+
+		time = np.nan
+		if kind == BLOCK_BURST:
+			counter, first, total = struct.unpack_from('<LHH', block, 4)
+			saturated = 0
+			part = np.frombuffer(block, '<i2', count, 12)
+		elif kind == BLOCK_BURST32:
+			counter, first, total, saturated = struct.unpack_from('<LHHH', block, 4)
+			part = np.frombuffer(block, '<i4', count, 14)
+		elif kind == BLOCK_BURST_TIMED:
+			counter, time, ms, first, total, saturated = struct.unpack_from('<LLHHHH', block, 4)
+			time += ms / 1000
+			part = np.frombuffer(block, '<i4', count, 20)
+		else:
+			counter, time, ms, first, total, saturated, count, k, sample = struct.unpack_from('<LLHHHHHBl', block, 4)
+			time += ms / 1000
+			part = decode_rice(block, count, k, sample)
+		if first == 0:
+			state.burst = (counter, time, [])
+		if state.burst is None or state.burst[0] != counter or sum(len(p) for p in state.burst[2]) != first:
+			print(f"Incomplete burst {counter}", file=sys.stderr)
+			state.burst = None
+			continue
+		state.burst[2].append(np.asarray(part, np.int32))
+		if first + len(part) == total:
+			bursts.append((counter, state.burst[1], saturated, start, total))
+			burst_at.append(b)
+			samples.extend(state.burst[2])
+			start += total
+			state.burst = None
+
+	yield from pieces(infos, banners, readings, reading_at, np.array(bursts, BURST), burst_at,
+		np.concatenate(samples) if samples else np.zeros(0, np.int32), energy, energy_at)
+
+###############################################################################
+
+# Pieces of segments, in order, from one or more log files
+def read(*paths, chunk_size=CHUNK_SIZE):
+	state = State()
+	for path in paths:
+		with open(path, "rb") as file:
+			binary = file.read(2) == struct.pack('<H', BLOCK_MAGIC)
+			file.seek(0)
+			if binary:
+				for buf in bin_chunks(file, chunk_size):
+					yield from parse_bin(buf, state)
+			else:
+				for buf in csv_chunks(file, chunk_size):
+					yield from parse_csv(buf, state)
+
+# Whole segments
+def load(*paths, chunk_size=CHUNK_SIZE):
+	segments = []
+	parts = []
+	def join():
+		if not parts:
+			return
+		bursts = np.concatenate([part.bursts for part in parts])
+		offset = 0
+		first = 0
+		for part in parts:
+			bursts['start'][first:first + len(part.bursts)] += offset
+			first += len(part.bursts)
+			offset += len(part.samples)
+		segments.append(Segment(parts[0],
+			np.concatenate([part.readings for part in parts]), bursts,
+			np.concatenate([part.samples for part in parts]),
+			np.concatenate([part.energy for part in parts])))
+		parts.clear()
+	for piece in read(*paths, chunk_size=chunk_size):
+		if parts and parts[0].index != piece.index:
+			join()
+		parts.append(piece)
+	join()
+	return segments
+
+if __name__ == "__main__":
+	for segment in load(*sys.argv[1:] or ["FLUXGATE.CSV"]):
+		print(f"Segment {segment.index}{' (new file)' if segment.new_file else ''}{' (self test failed)' if segment.failed else ''}: {segment.header}")
+		print(f"  {len(segment.readings)} readings, {len(segment.bursts)} bursts of {len(segment.samples)} samples, {len(segment.energy)} energy records")
@@ -1,18 +1,15 @@
-from matplotlib import pyplot
+import sys
 
-readings = []
+import numpy as np
+from matplotlib import pyplot
 
-file = open("fluxgate.csv")
+import fluxgate_log
 
 scaling = 48 * 5
 
-for line in file:
-	split = line.rstrip().split(',')
-	try:
-		int(split[0])
-		readings += [int(split[1])/scaling]
-	except:
-		pass
+# Readings, or the samples of bursts, of every segment one after another
+segments = fluxgate_log.load(*sys.argv[1:] or ["fluxgate.csv"])
+readings = np.concatenate([segment.readings['reading'] if len(segment.readings) else segment.samples for segment in segments] or [np.zeros(0)])
 
-pyplot.plot(readings)
+pyplot.plot(readings / scaling)
 pyplot.show()
@@ -1,15 +1,45 @@
 import struct
+import time
 
 log_interval = int(.25 * 1000)
-osr = 47
-burst = 1
+osr = 47 # Up to 100000 when oversampling, 512 in burst modes
+burst = 1 # 0: Oversample, 1: Burst, 2: Continuous bursts
+card_sleep_readings = 0 # Writes between SD card power cycles, continuous bursts keep it powered
+batch_size = 1 # Readings buffered per write, up to 102
+log_format = 0 # 0: FLUXGATE.CSV, 1: FLUXGATE.BIN, 2: FLUXGATE.BIN with compressed bursts
+adc_accumulation = 0 # ADC conversions per half-cycle, as a power of two (0-7)
+integration = 10 # Drive coil half-cycles per sample, even, up to 10000
+start_time = int(time.time()) # Unix time at power up, 0 carries on from the log
+preallocate = 64 # MB reserved for a new log file, 0 to grow it as needed
+rotate_size = 0 # MB per log file, 0 for no limit
+rotate_readings = 0 # Readings per log file, 0 for no limit. Either splits the log into FG000001.CSV/BIN, ...
+energy_log = 0 # Writes between energy records (see scripts/energy.py), 0 for none
 
 print(f"Log interval: {log_interval} ms")
 print(f"OSR: {osr}")
 print(f"Burst: {burst}")
+print(f"Card sleep: {'always powered' if burst == 2 else f'{card_sleep_readings} writes'}")
+print(f"Batch: {batch_size} readings")
+print(f"Format: {['CSV', 'binary', 'binary, compressed bursts'][log_format] if 0 <= log_format <= 2 else 'unknown, the logger falls back to CSV'}")
+print(f"Accumulation: {1 << adc_accumulation} conversions")
+print(f"Integration: {integration} half-cycles")
+print(f"Time: {time.strftime('%Y-%m-%d %H:%M:%S', time.gmtime(start_time)) if start_time else 'from log'}")
+print(f"Preallocate: {preallocate} MB")
+print(f"Rotate: {f'{rotate_size} MB' if rotate_size else 'no size limit'}, {f'{rotate_readings} readings' if rotate_readings else 'no reading limit'}")
+print(f"Energy records: {f'every {energy_log} writes' if energy_log else 'off'}")
 
 file = open('FLUXGATE.CFG', "wb")
 file.write(struct.pack('<l', log_interval))
 file.write(struct.pack('<l', osr))
 file.write(struct.pack('<l', burst))
+file.write(struct.pack('<l', card_sleep_readings))
+file.write(struct.pack('<l', batch_size))
+file.write(struct.pack('<l', log_format))
+file.write(struct.pack('<l', adc_accumulation))
+file.write(struct.pack('<l', integration))
+file.write(struct.pack('<L', start_time))
+file.write(struct.pack('<l', preallocate))
+file.write(struct.pack('<l', rotate_size))
+file.write(struct.pack('<l', rotate_readings))
+file.write(struct.pack('<l', energy_log))
 file.close()
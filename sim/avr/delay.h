@@ -0,0 +1,12 @@
+// Host stand-in for <avr/delay.h>, delays advance simulated time.
+#ifndef SIM_AVR_DELAY_H
+#define SIM_AVR_DELAY_H
+
+#include <stdint.h>
+
+void sim_delay_cycles(uint64_t cycles);
+
+#define _delay_ms(ms) sim_delay_cycles((uint64_t)((ms) * (F_CPU / 1000.0)))
+#define _delay_us(us) sim_delay_cycles((uint64_t)((us) * (F_CPU / 1000000.0)))
+
+#endif
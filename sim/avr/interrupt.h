@@ -0,0 +1,18 @@
+// Host stand-in for <avr/interrupt.h>. Interrupt handlers become plain
+// functions, which the simulator calls when their flags are set.
+#ifndef SIM_AVR_INTERRUPT_H
+#define SIM_AVR_INTERRUPT_H
+
+void sim_sei(void);
+void sim_cli(void);
+
+#define ISR(vector, ...) void vector(void)
+#define sei() sim_sei()
+#define cli() sim_cli()
+
+void TCB0_INT_vect(void);
+void TCB1_INT_vect(void);
+void ADC0_RESRDY_vect(void);
+void RTC_CNT_vect(void);
+
+#endif
@@ -0,0 +1,90 @@
+// Host stand-in for <avr/io.h>, see sim/sim.c.
+//
+// Peripherals are plain structs in memory, but every access goes through an
+// accessor function so the simulator can catch up on time and react to what
+// the firmware wrote since the last access. Registers with side effects on
+// write (SPI DATA, write-one-to-clear INTFLAGS) are widened to 16 bits: the
+// simulator sets bit 8 on everything it writes, so a value without it must
+// have come from the firmware.
+#ifndef SIM_AVR_IO_H
+#define SIM_AVR_IO_H
+
+#include <stdint.h>
+
+typedef volatile uint8_t reg8_t;
+typedef volatile uint16_t reg16_t;
+
+typedef struct {
+	reg8_t DIR, DIRSET, DIRCLR, OUT, OUTSET, OUTCLR, OUTTGL, IN;
+	reg16_t INTFLAGS;
+} PORT_t;
+
+typedef struct {
+	reg8_t CTRLA, CTRLB, INTCTRL;
+	reg16_t INTFLAGS;
+	reg16_t DATA;
+} SPI_t;
+
+typedef struct {
+	reg8_t CTRLA, CTRLB, CTRLC, CTRLD, CTRLE, CTRLF, SAMPCTRL;
+	reg8_t MUXPOS, MUXNEG, COMMAND, EVCTRL, INTCTRL;
+	reg16_t INTFLAGS;
+	reg16_t RES, WINLT, WINHT;
+} ADC_t;
+
+typedef struct {
+	reg8_t ADC0REF, DAC0REF, ACREF;
+} VREF_t;
+
+typedef struct {
+	reg8_t CTRLA, CTRLB, CTRLC, CTRLD, CTRLECLR, CTRLESET, CTRLFCLR, CTRLFSET;
+	reg8_t EVCTRL, INTCTRL;
+	reg16_t INTFLAGS;
+	reg16_t CNT, PER, CMP0, CMP1, CMP2;
+} TCA_SINGLE_t;
+
+typedef union {
+	TCA_SINGLE_t SINGLE;
+} TCA_t;
+
+typedef struct {
+	reg8_t CTRLA, CTRLB, EVCTRL, INTCTRL;
+	reg16_t INTFLAGS;
+	reg8_t STATUS, DBGCTRL, TEMP;
+	reg16_t CNT, CCMP;
+} TCB_t;
+
+typedef struct {
+	reg8_t CTRLA, STATUS, INTCTRL;
+	reg16_t INTFLAGS;
+	reg8_t TEMP, DBGCTRL, CALIB, CLKSEL;
+	reg16_t CNT, PER, CMP;
+	reg8_t PITCTRLA, PITSTATUS, PITINTCTRL, PITINTFLAGS, PITDBGCTRL;
+} RTC_t;
+
+typedef struct {
+	reg8_t CHANNEL0, CHANNEL1, CHANNEL2, CHANNEL3, CHANNEL4, CHANNEL5;
+	reg8_t USERADC0START;
+} EVSYS_t;
+
+PORT_t* sim_port(int n);
+SPI_t* sim_spi0(void);
+ADC_t* sim_adc0(void);
+VREF_t* sim_vref(void);
+TCA_t* sim_tca0(void);
+TCB_t* sim_tcb(int n);
+RTC_t* sim_rtc(void);
+EVSYS_t* sim_evsys(void);
+
+#define PORTA (*sim_port(0))
+#define PORTC (*sim_port(2))
+#define SPI0 (*sim_spi0())
+#define ADC0 (*sim_adc0())
+#define VREF (*sim_vref())
+#define TCA0 (*sim_tca0())
+#define TCB0 (*sim_tcb(0))
+#define TCB1 (*sim_tcb(1))
+#define RTC (*sim_rtc())
+#define EVSYS (*sim_evsys())
+
+#endif
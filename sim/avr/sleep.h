@@ -0,0 +1,20 @@
+// Host stand-in for <avr/sleep.h>, sleeping skips ahead to the next interrupt.
+#ifndef SIM_AVR_SLEEP_H
+#define SIM_AVR_SLEEP_H
+
+#include <stdint.h>
+
+#define SLEEP_MODE_IDLE 0
+#define SLEEP_MODE_STANDBY 1
+#define SLEEP_MODE_PWR_DOWN 2
+
+void sim_set_sleep_mode(uint8_t mode);
+void sim_sleep_enable(uint8_t enable);
+void sim_sleep(void);
+
+#define set_sleep_mode(mode) sim_set_sleep_mode(mode)
+#define sleep_enable() sim_sleep_enable(1)
+#define sleep_disable() sim_sleep_enable(0)
+#define sleep_cpu() sim_sleep()
+
+#endif
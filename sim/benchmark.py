@@ -0,0 +1,128 @@
+# Write amplification benchmark: runs the firmware in the simulator over a
+# set of logging scenarios, and reports what each reading costs on the card.
+#
+# Each scenario is run twice, for a short and a long time, on a fresh image.
+# Only the difference between the two is counted, so startup (mounting,
+# preallocation, the banner and self test) doesn't skew the numbers.
+#
+#   python3 sim/benchmark.py [--seconds 120] [--only name]
+#
+# Blocks are split up by the region of the file system they're in: FAT,
+# directory, FSINFO and data. Payload is how much the log file grew, and 
+# amplification is the bytes written to the card for each byte of it. The
+# size of a preallocated binary log lags behind, so its blocks are counted
+# on the card instead.
+import argparse
+import os
+import re
+import struct
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, HERE)
+sys.path.insert(0, os.path.join(HERE, '..', 'scripts'))
+from fatimage import Volume, SECTOR
+from decode_bin import crc16, BLOCK_MAGIC
+SIM = os.path.join(HERE, 'fluxgate-sim')
+FATIMAGE = os.path.join(HERE, 'fatimage.py')
+
+CARD_MB = 256
+CLUSTER = 4096
+
+# Config defaults, in FLUXGATE.CFG order (see scripts/write_cfg.py)
+DEFAULTS = dict(log_interval=1000, osr=10, burst=0, card_sleep_readings=0, batch_size=1,
+	log_format=0, adc_accumulation=0, integration=10, start_time=1790000000, preallocate=64,
+	rotate_size=0, rotate_readings=0)
+
+# name, config changes, percentage of the card filled up beforehand
+SCENARIOS = [
+	("csv", {}, 0),
+	("csv-osr1000", dict(osr=1000), 0),
+	("csv-250ms", dict(log_interval=250), 0),
+	("csv-batch10", dict(batch_size=10), 0),
+	("csv-grow", dict(preallocate=0), 0),
+	("csv-grow-full90", dict(preallocate=0), 90),
+	("csv-full90", {}, 90),
+	("bin", dict(log_format=1), 0),
+	("bin-batch10", dict(log_format=1, batch_size=10), 0),
+	("bin-grow", dict(log_format=1, preallocate=0), 0),
+	("csv-burst512", dict(burst=1, osr=512), 0),
+	("bin-burst512", dict(burst=1, osr=512, log_format=1), 0),
+	("rice-burst512", dict(burst=1, osr=512, log_format=2), 0),
+]
+
+def write_config(path, config):
+	with open(path, 'wb') as file:
+		for key, value in DEFAULTS.items():
+			file.write(struct.pack('<L' if key == 'start_time' else '<l', config.get(key, value)))
+
+def log_size(image):
+	total = 0
+	with open(image, 'rb') as file:
+		volume = Volume(file)
+		for name, cluster, size in volume.files():
+			if name.endswith('.BIN'):
+				# Valid blocks in a row from the start of the file
+				sector = volume.cluster_sector(cluster)
+				blocks = 0
+				while True:
+					block = volume.read(sector + blocks)
+					if len(block) < SECTOR or struct.unpack_from('<H', block)[0] != BLOCK_MAGIC:
+						break
+					if crc16(block[:510]) != struct.unpack_from('<H', block, 510)[0]:
+						break
+					blocks += 1
+				size = max(size, blocks * SECTOR)
+			if name.endswith('.BIN') or name.endswith('.CSV'):
+				total += size
+	return total
+
+def run(directory, config, fill, seconds):
+	cfg = os.path.join(directory, 'FLUXGATE.CFG')
+	image = os.path.join(directory, 'card.img')
+	write_config(cfg, config)
+	create = [sys.executable, FATIMAGE, 'create', image, '--size-mb', str(CARD_MB), '--cluster', str(CLUSTER), '--add', f'FLUXGATE.CFG={cfg}']
+	if fill:
+		create += ['--fill', f'FILL.DAT={CARD_MB * fill // 100 << 20}']
+	subprocess.run(create, check=True)
+	report = subprocess.run([SIM, '-t', str(seconds), image], capture_output=True, text=True, check=True).stderr
+
+	result = dict(payload=log_size(image))
+	result['readings'] = int(re.search(r'^sd: (\d+) readings', report, re.M)[1]) if 'readings' in report else 0
+	result['read'], result['written'] = map(int, re.search(r'^sd: (\d+) blocks read, (\d+) blocks written', report, re.M).groups())
+	result['busy'] = float(re.search(r'^sd: busy ([\d.]+) s', report, re.M)[1])
+	for region, read, written in re.findall(r' (\w+) (\d+)/(\d+)', re.search(r'^sd: blocks read/written by region:.*', report, re.M)[0]):
+		result[region] = int(written)
+	return result
+
+def main():
+	parser = argparse.ArgumentParser(description="Card cost per reading, over a set of logging scenarios")
+	parser.add_argument('--seconds', type=float, default=120, help="Length of the long run, the short one is a quarter of it")
+	parser.add_argument('--only', action='append', help="Only run the named scenarios")
+	args = parser.parse_args()
+	if not os.path.exists(SIM):
+		sys.exit(f"{SIM} not found, run make sim first")
+
+	columns = ['readings', 'written', 'read', 'FAT', 'directory', 'FSINFO', 'data', 'payload', 'amplification', 'busy ms']
+	print(f"{'scenario':<18}" + "".join(f"{column:>14}" for column in columns))
+	for name, changes, fill in SCENARIOS:
+		if args.only and name not in args.only:
+			continue
+		config = dict(DEFAULTS, **changes)
+		with tempfile.TemporaryDirectory() as directory:
+			short = run(directory, config, fill, args.seconds / 4)
+			long = run(directory, config, fill, args.seconds)
+		readings = long['readings'] - short['readings']
+		if readings <= 0:
+			print(f"{name:<18} no readings")
+			continue
+		per = {key: (long[key] - short[key]) / readings for key in long if key != 'readings'}
+		amplification = per['written'] * 512 / per['payload'] if per['payload'] else float('inf')
+		values = [readings, per['written'], per['read'], per['FAT'], per['directory'], per['FSINFO'], per['data'],
+			per['payload'], amplification, per['busy'] * 1000]
+		print(f"{name:<18}" + "".join(f"{value:>14}" if isinstance(value, int) else f"{value:>14.2f}" for value in values))
+
+if __name__ == '__main__':
+	main()
@@ -0,0 +1,243 @@
+# Make and inspect FAT16/FAT32 disk images for the simulator, without
+# needing mkfs or mtools. Images have no partition table, like a card
+# formated as a "superfloppy", which FatFs handles the same way.
+#
+#   python3 fatimage.py create card.img [--size-mb 1024] [--cluster 4096]
+#       [--add NAME=path] [--fill NAME=bytes]
+#   python3 fatimage.py ls card.img
+#   python3 fatimage.py cat card.img NAME
+import argparse
+import os
+import struct
+import sys
+
+SECTOR = 512
+
+def short_name(name):
+	base, _, ext = name.upper().partition('.')
+	return (base.ljust(8)[:8] + ext.ljust(3)[:3]).encode('ascii')
+
+class Volume:
+	def __init__(self, file):
+		self.file = file
+		bpb = self.read(0)
+		(self.spc, self.reserved, self.fats, self.root_entries, total16, _, fatsz16) = struct.unpack_from('<BHBHHBH', bpb, 13)
+		total32, fatsz32 = struct.unpack_from('<L', bpb, 32)[0], struct.unpack_from('<L', bpb, 36)[0]
+		self.total = total16 or total32
+		self.fat_size = fatsz16 or fatsz32
+		self.root_sectors = (self.root_entries * 32 + SECTOR - 1) // SECTOR
+		self.fat_start = self.reserved
+		self.root_start = self.fat_start + self.fats * self.fat_size
+		self.data_start = self.root_start + self.root_sectors
+		self.clusters = (self.total - self.data_start) // self.spc
+		self.fat32 = self.clusters >= 65525
+		self.root_cluster = struct.unpack_from('<L', bpb, 44)[0] if self.fat32 else 0
+		self.eoc = 0x0FFFFFF8 if self.fat32 else 0xFFF8
+		self.fat = bytearray(self.read(self.fat_start, self.fat_size))
+
+	def read(self, sector, count=1):
+		self.file.seek(sector * SECTOR)
+		return self.file.read(count * SECTOR)
+
+	def write(self, sector, data):
+		self.file.seek(sector * SECTOR)
+		self.file.write(data)
+
+	def cluster_sector(self, cluster):
+		return self.data_start + (cluster - 2) * self.spc
+
+	def get(self, cluster):
+		if self.fat32:
+			return struct.unpack_from('<L', self.fat, cluster * 4)[0] & 0x0FFFFFFF
+		return struct.unpack_from('<H', self.fat, cluster * 2)[0]
+
+	def set(self, cluster, value):
+		if self.fat32:
+			struct.pack_into('<L', self.fat, cluster * 4, value)
+		else:
+			struct.pack_into('<H', self.fat, cluster * 2, value)
+
+	def chain(self, cluster):
+		while 2 <= cluster < self.eoc:
+			yield cluster
+			cluster = self.get(cluster)
+
+	def allocate(self, count, start=None):
+		# Contiguous run of free clusters after the last used one, or at start
+		if start is None:
+			start = 2
+			for cluster in range(2, self.clusters + 2):
+				if self.get(cluster):
+					start = cluster + 1
+		if start + count > self.clusters + 2 or any(self.get(start + i) for i in range(count)):
+			sys.exit("Image full")
+		for i in range(count):
+			self.set(start + i, start + i + 1 if i < count - 1 else 0x0FFFFFFF if self.fat32 else 0xFFFF)
+		return start
+
+	def flush(self):
+		for i in range(self.fats):
+			self.write(self.fat_start + i * self.fat_size, self.fat)
+		if self.fat32:
+			info = bytearray(self.read(1))
+			free = sum(1 for cluster in range(2, self.clusters + 2) if not self.get(cluster))
+			struct.pack_into('<LL', info, 488, free, 0xFFFFFFFF)
+			self.write(1, info)
+
+	def root_sectors_list(self):
+		if self.fat32:
+			for cluster in self.chain(self.root_cluster):
+				for i in range(self.spc):
+					yield self.cluster_sector(cluster) + i
+		else:
+			yield from range(self.root_start, self.root_start + self.root_sectors)
+
+	def entries(self):
+		for sector in self.root_sectors_list():
+			data = self.read(sector)
+			for offset in range(0, SECTOR, 32):
+				yield sector, offset, data[offset:offset + 32]
+
+	def files(self):
+		for sector, offset, entry in self.entries():
+			if entry[0] == 0:
+				return
+			if entry[0] == 0xE5 or entry[11] & 0x0F == 0x0F or entry[11] & 0x08:
+				continue
+			name = entry[:8].decode('ascii').rstrip()
+			ext = entry[8:11].decode('ascii').rstrip()
+			cluster = struct.unpack_from('<H', entry, 26)[0] | struct.unpack_from('<H', entry, 20)[0] << 16
+			size = struct.unpack_from('<L', entry, 28)[0]
+			yield (name + '.' + ext if ext else name), cluster, size
+
+	def add(self, name, data, start=None):
+		clusters = max(1, -(-len(data) // (self.spc * SECTOR)))
+		start = self.allocate(clusters, start)
+		padded = data.ljust(clusters * self.spc * SECTOR, b'\0')
+		self.write(self.cluster_sector(start), padded)
+		for sector, offset, entry in self.entries():
+			if entry[0] in (0, 0xE5):
+				new = bytearray(32)
+				new[0:11] = short_name(name)
+				new[11] = 0x20 # Archive
+				struct.pack_into('<HHHHL', new, 20, start >> 16, 0, 0x21, start & 0xFFFF, len(data)) # 1980-01-01
+				block = bytearray(self.read(sector))
+				block[offset:offset + 32] = new
+				self.write(sector, block)
+				return
+		sys.exit("Root directory full")
+
+	# Like a PC does: frees the clusters and marks the entry deleted, the
+	# data stays where it was
+	def delete(self, name):
+		for sector, offset, entry in self.entries():
+			if entry[0] == 0:
+				return
+			if entry[:11] == short_name(name) and not entry[11] & 0x08:
+				cluster = struct.unpack_from('<H', entry, 26)[0] | struct.unpack_from('<H', entry, 20)[0] << 16
+				for c in list(self.chain(cluster)):
+					self.set(c, 0)
+				block = bytearray(self.read(sector))
+				block[offset] = 0xE5
+				self.write(sector, block)
+				return
+
+def create(path, size_mb, cluster_bytes):
+	total = size_mb * 1024 * 1024 // SECTOR
+	spc = cluster_bytes // SECTOR
+	# Pick FAT32 if there are enough clusters for it
+	fat32 = total // spc >= 65525 + 1024
+	reserved = 32 if fat32 else 4
+	root_sectors = 0 if fat32 else 32
+	fat_size = 1
+	while True:
+		clusters = (total - reserved - 2 * fat_size - root_sectors) // spc
+		needed = -(-(clusters + 2) * (4 if fat32 else 2) // SECTOR)
+		if needed <= fat_size:
+			break
+		fat_size = needed
+	if not fat32 and clusters < 4085:
+		sys.exit("Too small for FAT16, use a smaller cluster size")
+
+	with open(path, 'wb') as file:
+		file.truncate(total * SECTOR)
+		bpb = bytearray(SECTOR)
+		bpb[0:3] = b'\xEB\x58\x90'
+		bpb[3:11] = b'MSWIN4.1'
+		struct.pack_into('<HBHBHHBHHHLL', bpb, 11, SECTOR, spc, reserved, 2, 0 if fat32 else 512,
+			0 if fat32 or total > 0xFFFF else total, 0xF8, 0 if fat32 else fat_size, 63, 255, 0,
+			total if fat32 or total > 0xFFFF else 0)
+		if fat32:
+			struct.pack_into('<LHHLHH', bpb, 36, fat_size, 0, 0, 2, 1, 6)
+			struct.pack_into('<BBBL11s8s', bpb, 64, 0x80, 0, 0x29, 0x12345678, b'NO NAME    ', b'FAT32   ')
+		else:
+			struct.pack_into('<BBBL11s8s', bpb, 36, 0x80, 0, 0x29, 0x12345678, b'NO NAME    ', b'FAT16   ')
+		bpb[510:512] = b'\x55\xAA'
+		file.seek(0)
+		file.write(bpb)
+
+		fat = bytearray(SECTOR)
+		if fat32:
+			file.seek(6 * SECTOR)
+			file.write(bpb)
+			info = bytearray(SECTOR)
+			struct.pack_into('<L', info, 0, 0x41615252)
+			struct.pack_into('<LLL', info, 484, 0x61417272, clusters - 1, 3)
+			struct.pack_into('<L', info, 508, 0xAA550000)
+			file.seek(SECTOR)
+			file.write(info)
+			struct.pack_into('<LLL', fat, 0, 0x0FFFFFF8, 0x0FFFFFFF, 0x0FFFFFFF) # Root directory in cluster 2
+		else:
+			struct.pack_into('<HH', fat, 0, 0xFFF8, 0xFFFF)
+		for i in range(2):
+			file.seek((reserved + i * fat_size) * SECTOR)
+			file.write(fat)
+
+def main():
+	parser = argparse.ArgumentParser(description="Make and inspect FAT disk images")
+	commands = parser.add_subparsers(dest='command', required=True)
+	make = commands.add_parser('create')
+	make.add_argument('image')
+	make.add_argument('--size-mb', type=int, default=1024)
+	make.add_argument('--cluster', type=int, default=4096, help="Cluster size in bytes")
+	make.add_argument('--add', action='append', default=[], metavar='NAME=path', help="Copy a file into the root directory")
+	make.add_argument('--fill', action='append', default=[], metavar='NAME=bytes', help="Add a file of the given size")
+	listing = commands.add_parser('ls')
+	listing.add_argument('image')
+	cat = commands.add_parser('cat')
+	cat.add_argument('image')
+	cat.add_argument('name')
+	args = parser.parse_args()
+
+	if args.command == 'create':
+		create(args.image, args.size_mb, args.cluster)
+		with open(args.image, 'r+b') as file:
+			volume = Volume(file)
+			for item in args.add:
+				name, path = item.split('=', 1)
+				volume.add(name, open(path, 'rb').read())
+			for item in args.fill:
+				name, size = item.split('=', 1)
+				line = b'0,0\n'
+				volume.add(name, (line * (int(size) // len(line) + 1))[:int(size)])
+			volume.flush()
+
+	elif args.command == 'ls':
+		with open(args.image, 'rb') as file:
+			volume = Volume(file)
+			print(f"FAT{32 if volume.fat32 else 16}, {volume.clusters} clusters of {volume.spc * SECTOR} bytes")
+			for name, cluster, size in volume.files():
+				print(f"{name:12} {size:10} bytes, cluster {cluster}")
+
+	elif args.command == 'cat':
+		with open(args.image, 'rb') as file:
+			volume = Volume(file)
+			for name, cluster, size in volume.files():
+				if name == args.name.upper():
+					data = b''.join(volume.read(volume.cluster_sector(c), volume.spc) for c in volume.chain(cluster))
+					sys.stdout.buffer.write(data[:size])
+					return
+			sys.exit(f"{args.name}: not found")
+
+if __name__ == '__main__':
+	main()
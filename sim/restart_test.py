@@ -0,0 +1,274 @@
+# Restart tests: runs the firmware in the simulator, changes the card the
+# way a PC or a power cut might, runs it again, and checks the log carries
+# on where it should, without touching anything else on the card. Also
+# checks continuous bursts keep up with the default config.
+#
+#   python3 sim/restart_test.py [--only name]
+import argparse
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, HERE)
+sys.path.insert(0, os.path.join(HERE, '..', 'scripts'))
+from fatimage import Volume, SECTOR
+from decode_bin import crc16, BLOCK_MAGIC, BLOCK_HEADER, BLOCK_READINGS_TIMED, BLOCK_BURST_TIMED
+SIM = os.path.join(HERE, 'fluxgate-sim')
+FATIMAGE = os.path.join(HERE, 'fatimage.py')
+
+CARD_MB = 64
+CLUSTER = 4096
+
+# Config defaults, in FLUXGATE.CFG order (see scripts/write_cfg.py)
+DEFAULTS = dict(log_interval=250, osr=10, burst=0, card_sleep_readings=0, batch_size=1,
+	log_format=1, adc_accumulation=0, integration=10, start_time=1790000000, preallocate=1,
+	rotate_size=0, rotate_readings=0, energy_log=0)
+
+def write_config(path, config):
+	with open(path, 'wb') as file:
+		for key, value in DEFAULTS.items():
+			file.write(struct.pack('<L' if key == 'start_time' else '<l', config.get(key, value)))
+
+def create(directory, changes):
+	cfg = os.path.join(directory, 'FLUXGATE.CFG')
+	image = os.path.join(directory, 'card.img')
+	write_config(cfg, dict(DEFAULTS, **changes))
+	subprocess.run([sys.executable, FATIMAGE, 'create', image, '--size-mb', str(CARD_MB), '--cluster', str(CLUSTER),
+		'--add', f'FLUXGATE.CFG={cfg}'], check=True)
+	return image
+
+def simulate(image, seconds):
+	subprocess.run([SIM, '-t', str(seconds), image], capture_output=True, check=True)
+
+def find(volume, name):
+	for file, cluster, size in volume.files():
+		if file == name:
+			return cluster, size
+	return None, 0
+
+def read_file(volume, name):
+	cluster, size = find(volume, name)
+	data = b''.join(volume.read(volume.cluster_sector(c), volume.spc) for c in volume.chain(cluster))
+	return data[:size]
+
+# A binary log, including the blocks written past the end of the file
+# since its size was last updated, the way the next startup finds them
+def read_written(volume, name):
+	cluster, size = find(volume, name)
+	chain = b''.join(volume.read(volume.cluster_sector(c), volume.spc) for c in volume.chain(cluster))
+	end = size
+	while end < len(chain) and bin_counters(chain[:end + SECTOR]) is not None:
+		end += SECTOR
+	return chain[:end]
+
+# Counters of the readings in a binary log, a list for each startup, or
+# None if a block doesn't check out
+def bin_counters(data):
+	startups = []
+	for offset in range(0, len(data) - SECTOR + 1, SECTOR):
+		block = data[offset:offset + SECTOR]
+		magic, kind, count = struct.unpack_from('<HBB', block)
+		if magic != BLOCK_MAGIC or crc16(block[:510]) != struct.unpack_from('<H', block, 510)[0]:
+			return None
+		if kind == BLOCK_HEADER:
+			startups.append([])
+		elif kind == BLOCK_READINGS_TIMED and startups:
+			startups[-1] += [struct.unpack_from('<L', block, 4 + 20 * i)[0] for i in range(count)]
+	return startups
+
+# Every startup is in the log, and nothing was lost or written twice: the
+# counter starts at 0 after each header, and goes up by one
+def check_bin(volume, name, runs):
+	return check_counters(name, bin_counters(read_file(volume, name)), runs)
+
+def check_counters(name, startups, runs):
+	if startups is None:
+		return f"{name} has a bad block"
+	if len(startups) != runs:
+		return f"{name} has {len(startups)} startups, expected {runs}"
+	for counters in startups:
+		if not counters or counters != list(range(len(counters))):
+			return f"{name} has readings missing"
+	return None
+
+###############################################################################
+# Tests, each returns None if it passed, or what went wrong
+
+# Disk checkers treat the preallocated clusters past the end of the file as
+# lost, and free them. Another file can then end up in them, which must not
+# be overwritten.
+def test_checked_card(directory):
+	image = create(directory, {})
+	simulate(image, 450) # Past the first size update, 64 blocks of 25 readings
+	with open(image, 'r+b') as file:
+		volume = Volume(file)
+		cluster, size = find(volume, 'FLUXGATE.BIN')
+		clusters = list(volume.chain(cluster))
+		keep = max(1, -(-size // (volume.spc * SECTOR)))
+		for c in clusters[keep:]:
+			volume.set(c, 0)
+		volume.set(clusters[keep - 1], volume.eoc | 7)
+		# Then a PC writes a file into them
+		data = b'PC file '.ljust(volume.spc * SECTOR, b'!')
+		volume.add('OTHER.DAT', data, clusters[keep])
+		volume.flush()
+	simulate(image, 20)
+	with open(image, 'rb') as file:
+		volume = Volume(file)
+		if read_file(volume, 'OTHER.DAT') != data:
+			return "OTHER.DAT was overwritten"
+		return check_bin(volume, 'FLUXGATE.BIN', 2)
+
+# A PC replaces the log with another file that starts in the same cluster,
+# and is at least as long, but goes on elsewhere. The old clusters go to
+# other files.
+def test_replaced_log(directory):
+	image = create(directory, dict(log_format=0, preallocate=0))
+	simulate(image, 300)
+	simulate(image, 5) # Saves the tail, past the first cluster
+	with open(image, 'r+b') as file:
+		volume = Volume(file)
+		cluster, size = find(volume, 'FLUXGATE.CSV')
+		clusters = list(volume.chain(cluster))
+		for c in clusters:
+			volume.set(c, 0)
+		other = b'PC file '.ljust(volume.spc * SECTOR, b'!')
+		for i, c in enumerate(clusters[1:]):
+			volume.add(f'OTHER{i}.DAT', other, c)
+		replaced = b'Replaced on a PC\n' * (size // 17 + 1)
+		count = -(-len(replaced) // (volume.spc * SECTOR))
+		rest = volume.allocate(count - 1)
+		volume.set(clusters[0], rest)
+		chain = [clusters[0]] + list(range(rest, rest + count - 1))
+		for i, c in enumerate(chain):
+			volume.write(volume.cluster_sector(c), replaced[i * volume.spc * SECTOR:(i + 1) * volume.spc * SECTOR].ljust(volume.spc * SECTOR, b'\0'))
+		volume.flush()
+		for sector, offset, entry in volume.entries():
+			if entry[:11] == b'FLUXGATECSV':
+				block = bytearray(volume.read(sector))
+				struct.pack_into('<L', block, offset + 28, len(replaced))
+				volume.write(sector, block)
+	simulate(image, 5)
+	with open(image, 'rb') as file:
+		volume = Volume(file)
+		for name, cluster, size in volume.files():
+			if name.startswith('OTHER') and read_file(volume, name) != other:
+				return f"{name} was overwritten"
+		log = read_file(volume, 'FLUXGATE.CSV')
+		if not log.startswith(replaced + b'\n,,Fluxgate datalogger: restarted.'):
+			return "FLUXGATE.CSV wasn't appended to"
+	return None
+
+# Blocks written since the last size update, past the end of the file,
+# have to be found on startup, energy blocks included
+def test_energy_blocks(directory):
+	image = create(directory, dict(energy_log=2))
+	simulate(image, 30) # Stops between size updates
+	with open(image, 'rb') as file:
+		volume = Volume(file)
+		written = read_written(volume, 'FLUXGATE.BIN')
+		if len(written) == find(volume, 'FLUXGATE.BIN')[1]:
+			return "FLUXGATE.BIN has nothing past the size update"
+	simulate(image, 30)
+	with open(image, 'rb') as file:
+		volume = Volume(file)
+		if not read_file(volume, 'FLUXGATE.BIN').startswith(written):
+			return "FLUXGATE.BIN was overwritten"
+		return check_bin(volume, 'FLUXGATE.BIN', 2)
+
+# A PC deletes the log and FLUXGATE.STA, and the time is set again. The new
+# log is preallocated in the same clusters, and must not pick up the old
+# blocks still in them.
+def test_deleted_log(directory):
+	image = create(directory, {})
+	simulate(image, 30)
+	with open(image, 'r+b') as file:
+		volume = Volume(file)
+		volume.delete('FLUXGATE.BIN')
+		volume.delete('FLUXGATE.STA')
+		cfg = os.path.join(directory, 'FLUXGATE.CFG')
+		write_config(cfg, dict(DEFAULTS, start_time=DEFAULTS['start_time'] + 86400))
+		cluster, size = find(volume, 'FLUXGATE.CFG')
+		with open(cfg, 'rb') as config:
+			volume.write(volume.cluster_sector(cluster), config.read())
+		volume.flush()
+	simulate(image, 10)
+	simulate(image, 5) # Carries on after the blocks of the first run
+	with open(image, 'rb') as file:
+		log = read_written(Volume(file), 'FLUXGATE.BIN')
+	if len(log) < SECTOR or struct.unpack_from('<L', log, 26)[0] < DEFAULTS['start_time'] + 86400:
+		return "FLUXGATE.BIN doesn't start with the new header"
+	return check_counters('FLUXGATE.BIN', bin_counters(log), 2)
+
+# Continuous bursts with the default card_sleep_readings: the card has to
+# keep up, so no burst is dropped
+def test_continuous_bursts(directory):
+	image = create(directory, dict(burst=2, osr=256))
+	simulate(image, 6)
+	with open(image, 'rb') as file:
+		log = read_written(Volume(file), 'FLUXGATE.BIN')
+	counters = [struct.unpack_from('<L', log, offset + 4)[0] for offset in range(0, len(log), SECTOR)
+		if log[offset + 2] == BLOCK_BURST_TIMED and struct.unpack_from('<H', log, offset + 14)[0] == 0]
+	if len(counters) < 100 or counters != list(range(counters[0], counters[0] + len(counters))):
+		return f"{len(counters)} bursts, with gaps"
+	return None
+
+# FLUXGATE.STA of a rotated log is lost. The files closed by rotation are
+# full, and must not be added to.
+def test_lost_state(directory):
+	image = create(directory, dict(log_format=0, preallocate=0, rotate_size=1, burst=1, osr=512, log_interval=50))
+	simulate(image, 200)
+	with open(image, 'r+b') as file:
+		volume = Volume(file)
+		before = {name: size for name, cluster, size in volume.files() if name.startswith('FG')}
+		volume.delete('FLUXGATE.STA')
+		volume.flush()
+	if len(before) < 3:
+		return f"only {len(before)} files to start with"
+	simulate(image, 5)
+	with open(image, 'rb') as file:
+		after = {name: size for name, cluster, size in Volume(file).files() if name.startswith('FG')}
+	for name, size in before.items():
+		if after[name] != size:
+			return f"{name} was added to"
+	if len(after) != len(before) + 1:
+		return "no new file was started"
+	return None
+
+# A slow log shows up on a PC without a restart: the file size is updated
+# every 10 minutes, even with few blocks written
+def test_slow_log_size(directory):
+	image = create(directory, dict(log_interval=60000))
+	simulate(image, 1500)
+	with open(image, 'rb') as file:
+		volume = Volume(file)
+		written = bin_counters(read_written(volume, 'FLUXGATE.BIN'))
+		shown = bin_counters(read_file(volume, 'FLUXGATE.BIN'))
+	if not shown or len(shown[0]) < len(written[0]) - 11:
+		return f"{len(shown[0]) if shown else 0} of {len(written[0])} readings in the file"
+	return None
+
+TESTS = {name[5:]: test for name, test in globals().items() if name.startswith('test_')}
+
+def main():
+	parser = argparse.ArgumentParser(description="Restart the firmware over changed cards, and check the log")
+	parser.add_argument('--only', action='append', help="Only run the named tests")
+	args = parser.parse_args()
+	if not os.path.exists(SIM):
+		sys.exit(f"{SIM} not found, run make sim first")
+
+	failed = 0
+	for name, test in TESTS.items():
+		if args.only and name not in args.only:
+			continue
+		with tempfile.TemporaryDirectory() as directory:
+			error = test(directory)
+		print(f"{name:<20} {'FAIL: ' + error if error else 'ok'}")
+		failed += error is not None
+	sys.exit(1 if failed else 0)
+
+if __name__ == '__main__':
+	main()
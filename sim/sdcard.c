@@ -0,0 +1,439 @@
+// SD card emulator, talks the SPI mode protocol one byte at a time.
+//
+// Emulates an SDHC card (block addressed, 512 byte blocks) backed by a disk
+// image file. Supports the commands the firmware uses: CMD0, 8, 9, 12, 13,
+// 16, 17, 18, 24, 25, 55, 58, 59 and ACMD23, 41. While the card is busy
+// programing it holds the data line low, so busy waits take real time.
+//
+// How long it's busy for is modeled on how flash cards work: each block 
+// takes the program time, and writing into an erase block (allocation unit)
+// other than the few the card has open costs an extra erase time, to close
+// one and open another. Every so often the card also stalls for garbage
+// collection. See sd_configure().
+//
+// Blocks read and written are also counted by what part of the FAT file 
+// system they're in, to see how much of the card traffic is overhead.
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+
+// Timing
+#define INIT_TIME 0.020 // From the first ACMD41 to ready
+#define READ_LATENCY 0.0002 // Command to data token
+#define STOP_TIME 0.0002 // After a multiblock write
+
+// Write timing, set by sd_configure()
+static double program_time = 0.0005; // Per block written
+static double erase_time = 0; // Moving on to an erase block that isn't open
+static uint32_t erase_sectors = 8192; // Erase block size
+static uint32_t gc_interval = 0; // Blocks written between garbage collections
+static double gc_time = 0;
+
+// Erase blocks the card has open, most recently used first
+#define OPEN_BLOCKS 2
+static uint32_t open_blocks[OPEN_BLOCKS] = {UINT32_MAX, UINT32_MAX};
+
+static FILE* image;
+static uint32_t image_sectors;
+
+// File system layout, from the boot sector of the image
+enum region {BOOT, FSINFO, FAT, DIRECTORY, DATA, REGIONS};
+static const char* region_names[REGIONS] = {"boot", "FSINFO", "FAT", "directory", "data"};
+static uint32_t volume_start, fsinfo_sector, fat_start, root_start, data_start;
+static uint32_t sectors_per_cluster, root_cluster;
+static int fat32;
+
+enum state {
+	IDLE, // Waiting for a command
+	READ_SINGLE, // Sending a block once it's ready
+	READ_MULTI, // Sending blocks until CMD12
+	WRITE_TOKEN, // Waiting for a data token
+	WRITE_DATA, // Recieving a block
+};
+
+static int powered = 0;
+static enum state state = IDLE;
+static int idle = 1; // R1 idle bit, cleared by ACMD41
+static int app_cmd = 0; // Last command was CMD55
+static int multi_write = 0;
+static uint64_t init_done = 0;
+
+static uint8_t command[6];
+static int command_len = 0;
+
+// Bytes waiting to be sent to the host
+static uint8_t out[600];
+static int out_head = 0, out_len = 0;
+
+static uint8_t block[514];
+static int block_len = 0;
+static uint32_t address; // Next block to read or write
+static uint64_t ready_at; // When the next read block is available
+static uint64_t busy_until; // Data line held low until then
+
+// Statistics
+static uint64_t commands[64], app_commands[64];
+static uint64_t busy_cycles[64]; // Busy time after each command
+static uint64_t blocks_read, blocks_written, bytes_clocked, busy_bytes;
+static uint64_t erase_block_changes, gc_stalls;
+static uint64_t region_reads[REGIONS], region_writes[REGIONS];
+static uint8_t last_command;
+
+void sd_configure(double program_ms, double erase_ms, uint32_t erase_kb, uint32_t gc_blocks, double gc_ms) {
+	program_time = program_ms / 1000;
+	erase_time = erase_ms / 1000;
+	erase_sectors = erase_kb * 2;
+	gc_interval = gc_blocks;
+	gc_time = gc_ms / 1000;
+}
+
+static uint16_t get16(const uint8_t* data) {
+	return data[0] | data[1] << 8;
+}
+
+static uint32_t get32(const uint8_t* data) {
+	return get16(data) | (uint32_t)get16(data + 2) << 16;
+}
+
+// Find the FAT regions. An MBR is followed to the first partition, and
+// anything that isn't FAT is counted as data.
+static void read_layout(void) {
+	uint8_t sector[512];
+	if (pread(fileno(image), sector, 512, 0) != 512) return;
+	if (get16(&sector[11]) != 512) {
+		volume_start = get32(&sector[0x1C6]);
+		if (pread(fileno(image), sector, 512, (off_t)volume_start * 512) != 512) return;
+		if (get16(&sector[11]) != 512) {
+			data_start = 0;
+			return;
+		}
+	}
+	sectors_per_cluster = sector[13];
+	uint32_t fat_size = get16(&sector[22]) ? get16(&sector[22]) : get32(&sector[36]);
+	fat32 = get16(&sector[22]) == 0;
+	fat_start = volume_start + get16(&sector[14]);
+	root_start = fat_start + sector[16] * fat_size;
+	data_start = root_start + (get16(&sector[17]) * 32 + 511) / 512;
+	root_cluster = fat32 ? get32(&sector[44]) : 0;
+	fsinfo_sector = fat32 ? volume_start + get16(&sector[48]) : 0;
+}
+
+static uint32_t fat_entry(uint32_t cluster) {
+	uint8_t entry[4] = {0};
+	off_t offset = (off_t)fat_start * 512 + cluster * (fat32 ? 4 : 2);
+	if (pread(fileno(image), entry, fat32 ? 4 : 2, offset) < 0) return 0;
+	return fat32 ? get32(entry) & 0x0FFFFFFF : get16(entry);
+}
+
+static enum region region(uint32_t sector) {
+	if (sector < volume_start || !sectors_per_cluster) return DATA;
+	if (fat32 && sector == fsinfo_sector) return FSINFO;
+	if (sector < fat_start) return BOOT;
+	if (sector < root_start) return FAT;
+	if (sector < data_start) return DIRECTORY;
+	if (!fat32) return DATA;
+
+	// The FAT32 root directory is a cluster chain like any file
+	uint32_t cluster = (sector - data_start) / sectors_per_cluster + 2;
+	for (uint32_t root = root_cluster, n = 0; root >= 2 && root < 0x0FFFFFF8 && n < 65536; root = fat_entry(root), n++) {
+		if (root == cluster) return DIRECTORY;
+	}
+	return DATA;
+}
+
+int sd_open_image(const char* path) {
+	image = fopen(path, "r+b");
+	if (!image) {
+		perror(path);
+		return 1;
+	}
+	fseek(image, 0, SEEK_END);
+	image_sectors = ftell(image) / 512;
+	read_layout();
+	return 0;
+}
+
+static void queue(const uint8_t* data, int len) {
+	if (out_head) {
+		memmove(out, out + out_head, out_len);
+		out_head = 0;
+	}
+	memcpy(out + out_len, data, len);
+	out_len += len;
+}
+
+static void queue_byte(uint8_t byte) {
+	queue(&byte, 1);
+}
+
+static void reset(void) {
+	state = IDLE;
+	idle = 1;
+	app_cmd = 0;
+	init_done = 0;
+	command_len = 0;
+	out_head = out_len = 0;
+	busy_until = 0;
+}
+
+void sd_power(int on) {
+	powered = on;
+	reset();
+}
+
+static void read_sector(uint32_t sector, uint8_t* buff) {
+	memset(buff, 0, 512);
+	if (sector >= image_sectors) return;
+	if (pread(fileno(image), buff, 512, (off_t)sector * 512) < 0) perror("sd read");
+	blocks_read++;
+	region_reads[region(sector)]++;
+}
+
+static void write_sector(uint32_t sector, const uint8_t* buff) {
+	if (sector >= image_sectors) return;
+	region_writes[region(sector)]++;
+	if (pwrite(fileno(image), buff, 512, (off_t)sector * 512) < 0) perror("sd write");
+	blocks_written++;
+}
+
+// Hold the data line low for some time, counted against the last command
+static void busy(double seconds) {
+	uint64_t cycles = SIM_CYCLES(seconds);
+	busy_until = sim_now + cycles;
+	busy_cycles[last_command] += cycles;
+}
+
+// Busy time to program a block, with the erase block and garbage collection
+// overheads that come with it
+static double program_block(uint32_t sector) {
+	double time = program_time;
+	uint32_t erase_block = sector / erase_sectors;
+	int open = 0;
+	while (open < OPEN_BLOCKS - 1 && open_blocks[open] != erase_block) open++;
+	if (open_blocks[open] != erase_block) {
+		time += erase_time;
+		erase_block_changes++;
+	}
+	memmove(&open_blocks[1], &open_blocks[0], open * sizeof(open_blocks[0]));
+	open_blocks[0] = erase_block;
+
+	if (gc_interval && blocks_written % gc_interval == 0) {
+		time += gc_time;
+		gc_stalls++;
+	}
+	return time;
+}
+
+// Data token, block and dummy CRC
+static void queue_block(const uint8_t* data, int len) {
+	queue_byte(0xFE);
+	queue(data, len);
+	queue_byte(0xFF);
+	queue_byte(0xFF);
+}
+
+static void send_csd(void) {
+	// CSD version 2.0, 25 MHz, 512 byte blocks
+	uint32_t c_size = image_sectors / 1024 - 1;
+	uint8_t csd[16] = {0x40, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00,
+		(c_size >> 16) & 0x3F, c_size >> 8, c_size, 0x7F, 0x80, 0x0A, 0x40, 0x00, 0x01};
+	queue_byte(0xFF);
+	queue_block(csd, 16);
+}
+
+static void execute(uint8_t cmd, uint32_t arg) {
+	uint8_t r1 = idle;
+	queue_byte(0xFF); // One byte of response delay
+
+	if (app_cmd) {
+		app_cmd = 0;
+		app_commands[cmd]++;
+		if (cmd == 41) {
+			if (!init_done) init_done = sim_now + SIM_CYCLES(INIT_TIME);
+			if (sim_now >= init_done) idle = 0;
+			queue_byte(idle);
+			return;
+		}
+		if (cmd == 23) {
+			queue_byte(r1);
+			return;
+		}
+	}
+	commands[cmd]++;
+	last_command = cmd;
+
+	switch (cmd) {
+	case 0: // Reset
+		reset();
+		queue_byte(0xFF);
+		queue_byte(0x01);
+		break;
+	case 8: // Interface condition, echo the voltage and check pattern
+		queue_byte(r1);
+		queue_byte(0x00);
+		queue_byte(0x00);
+		queue_byte((arg >> 8) & 0xF);
+		queue_byte(arg);
+		break;
+	case 9: // CSD
+		queue_byte(r1);
+		send_csd();
+		break;
+	case 12: // Stop transmission
+		out_head = out_len = 0;
+		state = IDLE;
+		queue_byte(0xFF); // Stuff byte
+		queue_byte(r1);
+		busy(STOP_TIME / 10);
+		break;
+	case 13: // Status
+		queue_byte(r1);
+		queue_byte(0x00);
+		break;
+	case 16: // Block length
+	case 59: // CRC on/off
+		queue_byte(r1);
+		break;
+	case 17: // Read single block
+	case 18: // Read multiple blocks
+		if (arg >= image_sectors) {
+			queue_byte(r1 | 0x20); // Address error
+			break;
+		}
+		queue_byte(r1);
+		address = arg;
+		ready_at = sim_now + SIM_CYCLES(READ_LATENCY);
+		state = cmd == 17 ? READ_SINGLE : READ_MULTI;
+		break;
+	case 24: // Write single block
+	case 25: // Write multiple blocks
+		if (arg >= image_sectors) {
+			queue_byte(r1 | 0x20);
+			break;
+		}
+		queue_byte(r1);
+		address = arg;
+		multi_write = cmd == 25;
+		state = WRITE_TOKEN;
+		break;
+	case 55: // Application command follows
+		app_cmd = 1;
+		queue_byte(r1);
+		break;
+	case 58: // OCR: Powered up, block addressed, 2.7-3.6 V
+		queue_byte(r1);
+		queue_byte(idle ? 0x40 : 0xC0);
+		queue_byte(0xFF);
+		queue_byte(0x80);
+		queue_byte(0x00);
+		break;
+	default:
+		queue_byte(r1 | 0x04); // Illegal command
+		break;
+	}
+}
+
+// Handle a byte from the host
+static void recieve(uint8_t mosi) {
+	if (state == WRITE_TOKEN) {
+		// Tokens are ignored while busy, the host is just polling
+		if (sim_now < busy_until || out_len) return;
+		if (mosi == 0xFE || mosi == 0xFC) {
+			state = WRITE_DATA;
+			block_len = 0;
+		} else if (mosi == 0xFD && multi_write) {
+			state = IDLE;
+			queue_byte(0xFF);
+			busy(STOP_TIME);
+		}
+		return;
+	}
+
+	if (state == WRITE_DATA) {
+		block[block_len++] = mosi;
+		if (block_len < 514) return; // Data and CRC
+		write_sector(address, block);
+		queue_byte(0x05); // Data accepted
+		busy(program_block(address++));
+		state = multi_write ? WRITE_TOKEN : IDLE;
+		return;
+	}
+
+	// Commands start with 01, and can interrupt a multiblock read
+	if (command_len == 0 && (mosi & 0xC0) != 0x40) return;
+	command[command_len++] = mosi;
+	if (command_len < 6) return;
+	command_len = 0;
+	if (state == READ_MULTI && (command[0] & 0x3F) != 12) return;
+	execute(command[0] & 0x3F, (uint32_t)command[1] << 24 | (uint32_t)command[2] << 16 | command[3] << 8 | command[4]);
+}
+
+// Pick the next byte to send to the host
+static uint8_t transmit(void) {
+	if (out_len) {
+		out_len--;
+		return out[out_head++];
+	}
+	if (sim_now < busy_until) {
+		busy_bytes++;
+		return 0x00;
+	}
+	if ((state == READ_SINGLE || state == READ_MULTI) && sim_now >= ready_at) {
+		uint8_t data[512];
+		read_sector(address++, data);
+		queue_block(data, 512);
+		ready_at = sim_now + SIM_CYCLES(READ_LATENCY);
+		if (state == READ_SINGLE) state = IDLE;
+		return transmit();
+	}
+	return 0xFF;
+}
+
+// Exchange one byte over SPI, called at the end of the byte
+uint8_t sd_exchange(uint8_t mosi, int selected) {
+	bytes_clocked++;
+	if (!powered || !selected) return 0xFF;
+	uint8_t miso = transmit();
+	recieve(mosi);
+	return miso;
+}
+
+// Totals, and averages per reading if there were any
+void sd_report(FILE* output, uint64_t readings) {
+	uint64_t busy_total = 0, command_total = 0;
+	for (int i = 0; i < 64; i++) {
+		busy_total += busy_cycles[i];
+		command_total += commands[i] + app_commands[i];
+	}
+	fprintf(output, "sd: %llu bytes clocked, %llu busy\n",
+		(unsigned long long)bytes_clocked, (unsigned long long)busy_bytes);
+	fprintf(output, "sd: %llu blocks read, %llu blocks written\n",
+		(unsigned long long)blocks_read, (unsigned long long)blocks_written);
+	fprintf(output, "sd: blocks read/written by region:");
+	for (int i = 0; i < REGIONS; i++) {
+		fprintf(output, " %s %llu/%llu", region_names[i], (unsigned long long)region_reads[i], (unsigned long long)region_writes[i]);
+	}
+	fprintf(output, "\n");
+	fprintf(output, "sd: busy %.3f s, %llu erase block changes, %llu garbage collection stalls\n",
+		SIM_SECONDS(busy_total), (unsigned long long)erase_block_changes, (unsigned long long)gc_stalls);
+	for (int i = 0; i < 64; i++) {
+		if (!commands[i]) continue;
+		fprintf(output, "sd: CMD%d x %llu", i, (unsigned long long)commands[i]);
+		if (busy_cycles[i]) fprintf(output, ", busy %.3f s", SIM_SECONDS(busy_cycles[i]));
+		fprintf(output, "\n");
+	}
+	for (int i = 0; i < 64; i++) {
+		if (app_commands[i]) fprintf(output, "sd: ACMD%d x %llu\n", i, (unsigned long long)app_commands[i]);
+	}
+	if (!readings) return;
+	fprintf(output, "sd: %llu readings\n", (unsigned long long)readings);
+	fprintf(output, "sd: per reading: %.1f bytes clocked, %.2f commands, %.2f blocks read, %.2f blocks written, busy %.3f ms\n",
+		(double)bytes_clocked / readings, (double)command_total / readings, (double)blocks_read / readings,
+		(double)blocks_written / readings, SIM_SECONDS(busy_total) * 1000 / readings);
+	fprintf(output, "sd: per reading, blocks written by region:");
+	for (int i = 0; i < REGIONS; i++) {
+		fprintf(output, " %s %.2f", region_names[i], (double)region_writes[i] / readings);
+	}
+	fprintf(output, "\n");
+}
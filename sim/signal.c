@@ -0,0 +1,63 @@
+// Synthetic fluxgate signal behind ADC0.RES.
+//
+// AIN22 is the Vdd/2 rail of the amplifier and AIN23 the amplifier output.
+// While the sensor is powered, the output sits on Vdd/2. When the drive coil
+// is being switched, the second harmonic from the core is added on top,
+// flipping sign with the drive coil phase. Its amplitude follows the field:
+// a constant offset, a slow drift, some 60 Hz mains pickup and white noise.
+#include <math.h>
+#include "sim.h"
+
+#define VDIV 1.560 // V
+
+static double field = 0.100; // V of amplifier output per half-cycle
+static double noise = 0.0005; // V rms
+
+void signal_configure(double field_mv, double noise_mv) {
+	field = field_mv / 1000;
+	noise = noise_mv / 1000;
+}
+
+// Deterministic normal noise (xorshift + Box-Muller), so runs are repeatable
+static double gaussian(void) {
+	static uint64_t state = 0x9E3779B97F4A7C15ull;
+	double u[2];
+	for (int i = 0; i < 2; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		u[i] = ((state >> 11) + 0.5) / 9007199254740992.0;
+	}
+	return sqrt(-2 * log(u[0])) * cos(2 * M_PI * u[1]);
+}
+
+static double pin_voltage(uint8_t mux, int sensor_on, int excited, int coil) {
+	double t = SIM_SECONDS(sim_now);
+	if (mux == 0x40 || !sensor_on) return 0; // GND, or amplifier unpowered
+
+	if (mux == 22) return VDIV;
+	if (mux == 23 && !excited) return VDIV + noise * gaussian();
+	if (mux == 23) {
+		double amplitude = field * (1 + 0.05 * sin(2 * M_PI * t / 600))
+			+ 0.002 * sin(2 * M_PI * 60 * t);
+		return VDIV + (coil ? -amplitude : amplitude) + noise * gaussian();
+	}
+	return 0;
+}
+
+// Run a single 12 bit conversion
+int16_t signal_convert(uint8_t muxpos, uint8_t muxneg, uint8_t ref, uint8_t differential, int sensor_on, int excited, int coil) {
+	const double references[8] = {1.024, 2.048, 4.096, 2.500, 0, 3.3, 0, 0};
+	double vref = references[ref & 0x7];
+	if (vref == 0) vref = 1.024;
+
+	double v = pin_voltage(muxpos, sensor_on, excited, coil);
+	if (differential) v -= pin_voltage(muxneg, sensor_on, excited, coil);
+
+	long code = lround(v / vref * (differential ? 2048 : 4096));
+	if (code > 2047 && differential) code = 2047;
+	if (code < -2048) code = -2048;
+	if (code > 4095) code = 4095;
+	if (code < 0 && !differential) code = 0;
+	return code;
+}
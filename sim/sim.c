@@ -0,0 +1,525 @@
+// Host simulator for the datalogger firmware.
+//
+// main.c is compiled for the host against the stand-in headers in sim/avr,
+// and runs unmodified against models of the peripherals it uses: ports,
+// SPI0 with an SD card behind it (sdcard.c), ADC0 with a synthetic sensor
+// (signal.c), TCA0, TCB0, the RTC and the event channel from TCB0 to the
+// ADC.
+//
+// Time is counted in CPU cycles. Code runs in zero time, except that every
+// register access costs IO_CYCLES, so polling loops make progress. SPI
+// transfers, ADC conversions, delays and sleeps take their real time, and
+// timer events and interrupts are run as time passes.
+//
+// Usage: fluxgate-sim [-t seconds] [-f field mV] [-n noise mV] [card timing] image
+//
+// The card's write timing can be set with -p (ms to program a block), -e (ms
+// to move on to an erase block that isn't open), -a (erase block size, kB),
+// and -g blocks:ms (garbage collection stall every so many blocks).
+//
+// Card statistics are also given per reading, counted as the times the 
+// sensor is powered up after the self test.
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "avr/io.h"
+#include "avr/interrupt.h"
+#include "avr/sleep.h"
+#include "sim.h"
+
+// main.c's main() is renamed by the build, this file has the real one
+#undef main
+int firmware_main(void);
+
+#define MARK 0x100 // Set on every register value written by the simulator
+#define IO_CYCLES 2
+#define ISR_CYCLES 20
+#define NEVER UINT64_MAX
+
+uint64_t sim_now = 0;
+static uint64_t sim_limit;
+
+static PORT_t ports[6];
+static SPI_t spi0;
+static ADC_t adc0;
+static VREF_t vref;
+static TCA_t tca0;
+static TCB_t tcb[2];
+static EVSYS_t evsys;
+static RTC_t rtc;
+
+// Interrupt flags, as the hardware sees them
+static uint8_t spi_flags, adc_flags, tca_flags, tcb_flags[2], rtc_flags;
+
+static uint8_t interrupts_on = 0, in_isr = 0, woke = 0;
+static uint8_t sleep_mode = SLEEP_MODE_IDLE, sleep_on = 0, sleeping = 0;
+
+// Statistics
+static uint64_t card_on_cycles, sensor_on_cycles, sleep_cycles, standby_cycles, last_account;
+static uint64_t spi_bytes, adc_conversions, interrupts, sensor_power_ups;
+
+static void run_until(uint64_t t);
+
+///////////////////////////////////////////////////////////////////////////////
+// Registers
+
+// Write-one-to-clear flags: a value without MARK came from the firmware
+static void w1c_sync(reg16_t* reg, uint8_t* flags) {
+	if (!(*reg & MARK)) *flags &= ~*reg;
+	*reg = MARK | *flags;
+}
+
+static void port_sync(PORT_t* port) {
+	if (port->OUTSET) port->OUT |= port->OUTSET;
+	if (port->OUTCLR) port->OUT &= ~port->OUTCLR;
+	if (port->OUTTGL) port->OUT ^= port->OUTTGL;
+	if (port->DIRSET) port->DIR |= port->DIRSET;
+	if (port->DIRCLR) port->DIR &= ~port->DIRCLR;
+	port->OUTSET = port->OUTCLR = port->OUTTGL = port->DIRSET = port->DIRCLR = 0;
+	port->IN = port->OUT;
+}
+
+static int card_powered(void) {
+	return ports[2].OUT & 1 << 0;
+}
+
+static int sensor_powered(void) {
+	return ports[2].OUT & 1 << 1;
+}
+
+static int coil_phase(void) {
+	return (ports[2].OUT & 1 << 3) != 0;
+}
+
+// The sensor only produces a signal while the drive coil is switching
+static uint64_t last_coil_edge = NEVER / 2;
+#define EXCITATION_TIMEOUT SIM_CYCLES(0.001)
+
+static int coil_excited(void) {
+	return sim_now - last_coil_edge < EXCITATION_TIMEOUT;
+}
+
+// Add up how long things were powered, up to time t
+static void account(uint64_t t) {
+	uint64_t dt = t - last_account;
+	if (card_powered()) card_on_cycles += dt;
+	if (sensor_powered()) sensor_on_cycles += dt;
+	if (sleeping) sleep_cycles += dt;
+	if (sleeping && sleep_mode != SLEEP_MODE_IDLE) standby_cycles += dt;
+	last_account = t;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SPI and the SD card
+
+static uint16_t spi_divider(void) {
+	const uint16_t prescaler[4] = {4, 16, 64, 128};
+	uint16_t div = prescaler[(spi0.CTRLA >> 1) & 0x3];
+	if (spi0.CTRLA & 1 << 4) div /= 2;
+	return div;
+}
+
+static void spi_sync(void) {
+	w1c_sync(&spi0.INTFLAGS, &spi_flags);
+	if (spi0.DATA & MARK) return;
+
+	// The firmware wrote a byte, clock it out
+	uint8_t mosi = spi0.DATA;
+	spi0.DATA = MARK | 0xFF;
+	run_until(sim_now + 8 * spi_divider());
+	spi0.DATA = MARK | sd_exchange(mosi, !(ports[0].OUT & 1 << 7));
+	spi_flags |= 1 << 7;
+	spi0.INTFLAGS = MARK | spi_flags;
+	spi_bytes++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ADC
+
+static int adc_busy = 0;
+static uint64_t adc_sample_at, adc_done_at;
+static int32_t adc_result; // Accumulated over SAMPNUM conversions
+static int adc_remaining; // Conversions left in this accumulation
+
+static uint32_t adc_clock(void) {
+	const uint8_t prescaler[16] = {2, 4, 6, 8, 10, 12, 14, 16, 20, 24, 28, 32, 40, 48, 56, 64};
+	return prescaler[adc0.CTRLC & 0xF];
+}
+
+// Schedule one conversion, the sample delay applies to each of them
+static void adc_convert(void) {
+	uint32_t sample_delay = (adc0.CTRLD & 0xF) + 2 + adc0.SAMPCTRL;
+	adc_sample_at = sim_now + sample_delay * adc_clock();
+	adc_done_at = adc_sample_at + 13 * adc_clock();
+}
+
+static void adc_start(void) {
+	if (!(adc0.CTRLA & 1) || adc_busy) return;
+	adc_busy = 1;
+	adc_result = 0;
+	adc_remaining = 1 << (adc0.CTRLB & 0x7);
+	adc_convert();
+	adc0.COMMAND = 1;
+}
+
+static void adc_event(void) {
+	if (sim_now >= adc_sample_at && adc_sample_at != NEVER) {
+		uint8_t differential = (adc0.CTRLA >> 5) & 1;
+		adc_result += signal_convert(adc0.MUXPOS, adc0.MUXNEG, vref.ADC0REF, differential, sensor_powered(), coil_excited(), coil_phase());
+		adc_sample_at = NEVER;
+	}
+	if (sim_now >= adc_done_at) {
+		adc_conversions++;
+		if (--adc_remaining) {
+			adc_convert();
+			return;
+		}
+		// More than 16 accumulated results are shifted down to fit RES
+		uint8_t sampnum = adc0.CTRLB & 0x7;
+		adc0.RES = sampnum > 4 ? adc_result >> (sampnum - 4) : adc_result;
+		adc0.COMMAND = 0;
+		adc_busy = 0;
+		adc_flags |= 1; // RESRDY
+		adc0.INTFLAGS = MARK | adc_flags;
+	}
+}
+
+static void adc_sync(void) {
+	w1c_sync(&adc0.INTFLAGS, &adc_flags);
+	if (adc0.COMMAND & 1) adc_start();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Timers
+
+static int tca_running = 0;
+static uint64_t tca_next;
+
+static uint64_t tca_period(void) {
+	const uint16_t prescaler[8] = {1, 2, 4, 8, 16, 64, 256, 1024};
+	return (uint64_t)(tca0.SINGLE.PER + 1) * prescaler[(tca0.SINGLE.CTRLA >> 1) & 0x7];
+}
+
+static void tca_sync(void) {
+	w1c_sync(&tca0.SINGLE.INTFLAGS, &tca_flags);
+	int enabled = tca0.SINGLE.CTRLA & 1;
+	if (enabled && !tca_running) tca_next = sim_now + tca_period();
+	tca_running = enabled;
+}
+
+static void tca_event(void) {
+	tca_flags |= 1; // OVF
+	tca0.SINGLE.INTFLAGS = MARK | tca_flags;
+	tca_next += tca_period();
+}
+
+static int tcb_running[2], tcb_stopped[2];
+static uint64_t tcb_next[2];
+
+static uint64_t tcb_divider(int n) {
+	return ((tcb[n].CTRLA >> 1) & 0x7) == 1 ? 2 : 1;
+}
+
+static uint64_t tcb_period(int n) {
+	return (uint64_t)(tcb[n].CCMP + 1) * tcb_divider(n);
+}
+
+static void tcb_sync(int n) {
+	w1c_sync(&tcb[n].INTFLAGS, &tcb_flags[n]);
+	if (tcb_stopped[n]) return;
+	int enabled = tcb[n].CTRLA & 1;
+	if (enabled && !tcb_running[n]) tcb_next[n] = sim_now + tcb_period(n);
+	tcb_running[n] = enabled;
+	if (enabled) tcb[n].CNT = (tcb_period(n) - (tcb_next[n] - sim_now)) / tcb_divider(n);
+}
+
+// Without RUNSTDBY, the TCBs stop in standby and carry on where they were
+static void tcb_standby(int entering) {
+	for (int n = 0; n < 2; n++) {
+		if (entering && tcb_running[n] && !(tcb[n].CTRLA & 1 << 6)) {
+			tcb_next[n] -= sim_now; // Left until the next capture
+			tcb_running[n] = 0;
+			tcb_stopped[n] = 1;
+		} else if (!entering && tcb_stopped[n]) {
+			tcb_next[n] += sim_now;
+			tcb_running[n] = 1;
+			tcb_stopped[n] = 0;
+		}
+	}
+}
+
+static void tcb_event(int n) {
+	tcb_flags[n] |= 1; // CAPT
+	tcb[n].INTFLAGS = MARK | tcb_flags[n];
+	tcb_next[n] += tcb_period(n);
+
+	// Event channel 0 from TCB0 capture can start the ADC
+	if (n == 0 && evsys.CHANNEL0 == 0xA0 && evsys.USERADC0START == 1 && (adc0.EVCTRL & 1)) {
+		adc_start();
+	}
+}
+
+// The RTC counts 32.768 kHz ticks, divided by the prescaler. Its count is
+// worked out from the time it was started, so it doesn't need an event per
+// tick, and CNT is refreshed on every access. Writing CNT restarts the
+// count from the new value.
+static int rtc_running = 0;
+static uint64_t rtc_start; // When the count was 0
+static uint64_t rtc_counted; // Ticks since rtc_start, up to now
+static uint16_t rtc_cnt_shown;
+static uint64_t rtc_next_ovf, rtc_next_cmp;
+
+// Cycles from the start of the count to the given tick
+static uint64_t rtc_cycles(uint64_t ticks) {
+	uint32_t prescaler = 1 << ((rtc.CTRLA >> 3) & 0xF);
+	return (ticks * prescaler * F_CPU + 32767) / 32768;
+}
+
+// Work out when the next overflow and compare match will be
+static void rtc_schedule(void) {
+	uint64_t period = (uint64_t)rtc.PER + 1;
+	uint64_t wraps = rtc_counted / period;
+	rtc_next_ovf = rtc_start + rtc_cycles((wraps + 1) * period);
+	uint64_t cmp = wraps * period + rtc.CMP;
+	if (cmp <= rtc_counted) cmp += period;
+	rtc_next_cmp = rtc_start + rtc_cycles(cmp);
+}
+
+static void rtc_count(void) {
+	uint32_t prescaler = 1 << ((rtc.CTRLA >> 3) & 0xF);
+	rtc_counted = (sim_now - rtc_start) * 32768 / F_CPU / prescaler;
+}
+
+// Carry on counting from count, as of now
+static void rtc_restart(uint16_t count) {
+	rtc_counted = count;
+	rtc_start = sim_now - rtc_cycles(count);
+	rtc_schedule();
+}
+
+static void rtc_sync(void) {
+	static uint16_t per = 0, cmp = 0;
+	w1c_sync(&rtc.INTFLAGS, &rtc_flags);
+	int enabled = rtc.CTRLA & 1;
+	if (enabled && (!rtc_running || rtc.CNT != rtc_cnt_shown)) rtc_restart(rtc.CNT);
+	else if (enabled && (rtc.PER != per || rtc.CMP != cmp)) rtc_schedule();
+	rtc_running = enabled;
+	per = rtc.PER;
+	cmp = rtc.CMP;
+
+	if (rtc_running) rtc_count();
+	rtc.CNT = rtc_cnt_shown = rtc_counted % ((uint64_t)rtc.PER + 1);
+	rtc.STATUS = 0; // Never busy synchronizing
+}
+
+static void rtc_event(void) {
+	rtc_count();
+	if (rtc_next_ovf <= sim_now) rtc_flags |= 1; // OVF
+	if (rtc_next_cmp <= sim_now) rtc_flags |= 2; // CMP
+	rtc.INTFLAGS = MARK | rtc_flags;
+	rtc_schedule();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Time and interrupts
+
+static void sync_all(void) {
+	static int coil_was = 0;
+	for (int i = 0; i < 6; i++) port_sync(&ports[i]);
+	if (coil_phase() != coil_was) last_coil_edge = sim_now;
+	coil_was = coil_phase();
+
+	static int sensor_was_powered = 0;
+	if (sensor_powered() && !sensor_was_powered) sensor_power_ups++;
+	sensor_was_powered = sensor_powered();
+
+	static int card_was_powered = 0;
+	if (!card_powered() != !card_was_powered) sd_power(card_powered());
+	card_was_powered = card_powered();
+
+	tca_sync();
+	for (int i = 0; i < 2; i++) tcb_sync(i);
+	rtc_sync();
+	adc_sync();
+	spi_sync();
+}
+
+static uint64_t next_event(void) {
+	uint64_t next = NEVER;
+	if (tca_running && tca_next < next) next = tca_next;
+	for (int i = 0; i < 2; i++) {
+		if (tcb_running[i] && tcb_next[i] < next) next = tcb_next[i];
+	}
+	if (adc_busy && adc_sample_at < next) next = adc_sample_at;
+	if (adc_busy && adc_done_at < next) next = adc_done_at;
+	if (rtc_running && rtc_next_ovf < next) next = rtc_next_ovf;
+	if (rtc_running && rtc_next_cmp < next) next = rtc_next_cmp;
+	return next;
+}
+
+static void fire_events(void) {
+	if (tca_running && tca_next <= sim_now) tca_event();
+	for (int i = 0; i < 2; i++) {
+		if (tcb_running[i] && tcb_next[i] <= sim_now) tcb_event(i);
+	}
+	if (adc_busy) adc_event();
+	if (rtc_running && (rtc_next_ovf <= sim_now || rtc_next_cmp <= sim_now)) rtc_event();
+}
+
+// Only built in with TRACE=1
+__attribute__((weak)) void TCB1_INT_vect(void) {}
+
+// Find an enabled interrupt with its flag set
+static void (*pending_vector(void))(void) {
+	sync_all();
+	if ((tcb[0].INTCTRL & 1) && (tcb_flags[0] & 1)) return TCB0_INT_vect;
+	if ((tcb[1].INTCTRL & 1) && (tcb_flags[1] & 1)) return TCB1_INT_vect;
+	if ((adc0.INTCTRL & 1) && (adc_flags & 1)) {
+		// Reading RES clears the flag, which the handler always does
+		adc_flags &= ~1;
+		adc0.INTFLAGS = MARK | adc_flags;
+		return ADC0_RESRDY_vect;
+	}
+	if (rtc.INTCTRL & rtc_flags & 3) return RTC_CNT_vect;
+	return 0;
+}
+
+static void dispatch(void) {
+	if (!interrupts_on || in_isr) return;
+	while (1) {
+		void (*vector)(void) = pending_vector();
+		if (!vector) return;
+		woke = 1;
+		in_isr = 1;
+		interrupts++;
+		run_until(sim_now + ISR_CYCLES);
+		vector();
+		in_isr = 0;
+	}
+}
+
+static void finish(void);
+
+static void run_until(uint64_t t) {
+	while (1) {
+		uint64_t next = next_event();
+		if (next > t) break;
+		account(next);
+		sim_now = next;
+		fire_events();
+		dispatch();
+	}
+	if (t > sim_now) {
+		account(t);
+		sim_now = t;
+	}
+	dispatch();
+	if (sim_now >= sim_limit && !in_isr) finish();
+}
+
+static void io_access(void) {
+	sync_all();
+	run_until(sim_now + IO_CYCLES);
+}
+
+PORT_t* sim_port(int n) {io_access(); return &ports[n];}
+SPI_t* sim_spi0(void) {io_access(); return &spi0;}
+ADC_t* sim_adc0(void) {io_access(); return &adc0;}
+VREF_t* sim_vref(void) {io_access(); return &vref;}
+TCA_t* sim_tca0(void) {io_access(); return &tca0;}
+TCB_t* sim_tcb(int n) {io_access(); return &tcb[n];}
+EVSYS_t* sim_evsys(void) {io_access(); return &evsys;}
+RTC_t* sim_rtc(void) {io_access(); return &rtc;}
+
+void sim_delay_cycles(uint64_t cycles) {
+	sync_all();
+	run_until(sim_now + cycles);
+}
+
+void sim_sei(void) {
+	interrupts_on = 1;
+	sync_all();
+	dispatch();
+}
+
+void sim_cli(void) {
+	interrupts_on = 0;
+}
+
+void sim_set_sleep_mode(uint8_t mode) {sleep_mode = mode;}
+void sim_sleep_enable(uint8_t enable) {sleep_on = enable;}
+
+// Skip ahead until an interrupt runs
+void sim_sleep(void) {
+	if (!sleep_on) return;
+	sync_all();
+	woke = 0;
+	sleeping = 1;
+	if (sleep_mode != SLEEP_MODE_IDLE) tcb_standby(1);
+	while (!woke) {
+		uint64_t next = next_event();
+		if (next == NEVER || !interrupts_on) {
+			fprintf(stderr, "sim: sleeping with nothing to wake up the CPU\n");
+			finish();
+		}
+		run_until(next);
+	}
+	tcb_standby(0);
+	sleeping = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void finish(void) {
+	account(sim_now);
+	fprintf(stderr, "sim: %.3f s simulated\n", SIM_SECONDS(sim_now));
+	fprintf(stderr, "sim: card powered %.3f s, sensor powered %.3f s, CPU asleep %.3f s (%.3f s in standby)\n",
+		SIM_SECONDS(card_on_cycles), SIM_SECONDS(sensor_on_cycles), SIM_SECONDS(sleep_cycles), SIM_SECONDS(standby_cycles));
+	fprintf(stderr, "sim: %llu SPI bytes, %llu ADC conversions, %llu interrupts\n",
+		(unsigned long long)spi_bytes, (unsigned long long)adc_conversions, (unsigned long long)interrupts);
+	sd_report(stderr, sensor_power_ups > 1 ? sensor_power_ups - 1 : 0);
+	exit(0);
+}
+
+static void reset(void) {
+	spi0.DATA = MARK | 0xFF;
+	spi0.INTFLAGS = adc0.INTFLAGS = tca0.SINGLE.INTFLAGS = rtc.INTFLAGS = MARK;
+	rtc.PER = 0xFFFF;
+	for (int i = 0; i < 2; i++) tcb[i].INTFLAGS = MARK;
+	tca0.SINGLE.PER = 0xFFFF;
+}
+
+int main(int argc, char** argv) {
+	double seconds = 60, field = 100, noise = 0.5;
+	double program_ms = 0.5, erase_ms = 0, gc_ms = 0;
+	unsigned erase_kb = 4096, gc_blocks = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:f:n:p:e:a:g:")) != -1) {
+		switch (opt) {
+		case 't': seconds = atof(optarg); break;
+		case 'f': field = atof(optarg); break;
+		case 'n': noise = atof(optarg); break;
+		case 'p': program_ms = atof(optarg); break;
+		case 'e': erase_ms = atof(optarg); break;
+		case 'a': erase_kb = atoi(optarg); break;
+		case 'g': sscanf(optarg, "%u:%lf", &gc_blocks, &gc_ms); break;
+		default:
+			fprintf(stderr, "Usage: %s [-t seconds] [-f field mV] [-n noise mV] [-p program ms] [-e erase ms] [-a erase block kB] [-g blocks:stall ms] image\n", argv[0]);
+			return 1;
+		}
+	}
+	if (erase_kb < 1) erase_kb = 1;
+	if (optind >= argc) {
+		fprintf(stderr, "%s: no disk image given\n", argv[0]);
+		return 1;
+	}
+	if (sd_open_image(argv[optind])) return 1;
+
+	sim_limit = SIM_CYCLES(seconds);
+	signal_configure(field, noise);
+	sd_configure(program_ms, erase_ms, erase_kb, gc_blocks, gc_ms);
+	reset();
+	firmware_main();
+	finish();
+	return 0;
+}
@@ -0,0 +1,24 @@
+// Interfaces between the parts of the host simulator.
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Simulated time in CPU cycles since reset
+extern uint64_t sim_now;
+#define SIM_SECONDS(cycles) ((double)(cycles) / F_CPU)
+#define SIM_CYCLES(seconds) ((uint64_t)((seconds) * F_CPU))
+
+// sdcard.c: SD card in SPI mode, backed by a disk image
+int sd_open_image(const char* path);
+void sd_power(int on);
+uint8_t sd_exchange(uint8_t mosi, int selected);
+void sd_configure(double program_ms, double erase_ms, uint32_t erase_kb, uint32_t gc_blocks, double gc_ms);
+void sd_report(FILE* out, uint64_t readings);
+
+// signal.c: Fluxgate sensor and amplifier, as seen by the ADC
+void signal_configure(double field_mv, double noise_mv);
+int16_t signal_convert(uint8_t muxpos, uint8_t muxneg, uint8_t ref, uint8_t differential, int sensor_on, int excited, int coil);
+
+#endif